@@ -15,6 +15,8 @@
 LOCAL_PATH := $(my-dir)
 subdir_makefiles := \
 	$(LOCAL_PATH)/libsensors/Android.mk \
-	$(LOCAL_PATH)/liblights/Android.mk
+	$(LOCAL_PATH)/liblights/Android.mk \
+	$(LOCAL_PATH)/recovery/Android.mk \
+	$(LOCAL_PATH)/tools/Android.mk
 
 include $(subdir_makefiles)
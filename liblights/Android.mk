@@ -25,9 +25,25 @@ LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 LOCAL_MODULE_TAGS := optional
 
 LOCAL_SRC_FILES := lights.c
-LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_SHARED_LIBRARIES := liblog libcutils
 LOCAL_PRELINK_MODULE := false
 
 include $(BUILD_SHARED_LIBRARY)
 
+# lights_test: the HAL on the host against a fake sysfs tree, reports the
+# node writes of scripted light sequences and the backlight fade throughput
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := lights_test
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SRC_FILES := tests/lights_test.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/tests/include
+LOCAL_CFLAGS := -DLIGHTS_STATS
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
 endif # !TARGET_SIMULATOR
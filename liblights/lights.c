@@ -17,6 +17,8 @@
 #define LOG_TAG "lights"
 
 #include <cutils/log.h>
+#include <cutils/atomic.h>
+#include <cutils/properties.h>
 
 #include <stdint.h>
 #include <string.h>
@@ -24,25 +26,104 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
 
 #include <sys/ioctl.h>
 #include <sys/types.h>
 
+#include <linux/input.h>
+#include <linux/lightsensor.h>
+
 #include <hardware/lights.h>
 
 #define LIGHT_ATTENTION	1
 #define LIGHT_NOTIFY 	2
 
+/* set to 1 to have set_light() queue the new state and return at once */
+#define LIGHTS_ASYNC_PROPERTY "ro.lights.async"
+
+/* set to 1 to let the HAL run auto-brightness itself; pair it with
+ * config_hardware_automatic_brightness_available in the overlay so the
+ * framework hands over with BRIGHTNESS_MODE_SENSOR */
+#define AUTO_BRIGHTNESS_PROPERTY "ro.lights.auto_brightness"
+
 /******************************************************************************/
 static struct light_state_t *g_notify;
 static struct light_state_t *g_attention;
-static pthread_once_t g_init = PTHREAD_ONCE_INIT;
-static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+/* module state lives from the first open_lights() to the last close */
+static pthread_mutex_t g_init_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_refs = 0;
+/* one lock per group of LEDs that share state, so that a slow write to
+ * one group (e.g. the trackball) never delays the LCD backlight */
+static pthread_mutex_t g_backlight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_buttons_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_battery_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_trackball_lock = PTHREAD_MUTEX_INITIALIZER;
 static int g_backlight = 255;
 static int g_buttons = 0;
+
+/*
+ * In async mode each light has a mailbox holding only its latest state.
+ * Writers publish under a sequence counter (odd while updating) and the
+ * worker thread re-reads until it sees a stable even value, so neither
+ * side ever blocks on the other.
+ */
+enum {
+    MAILBOX_BACKLIGHT,
+    MAILBOX_BUTTONS,
+    MAILBOX_BATTERY,
+    MAILBOX_NOTIFICATIONS,
+    MAILBOX_ATTENTION,
+    NUM_MAILBOXES,
+};
+
+struct light_mailbox {
+    volatile int32_t seq;
+    volatile int32_t pending;
+    struct light_state_t state;
+};
+
+struct light_context_t {
+    struct light_device_t device; // must be first
+    int mailbox;
+};
+
+static struct light_mailbox g_mailboxes[NUM_MAILBOXES];
+static int g_async = 0;
+static int g_worker_pipe[2] = { -1, -1 };
+static pthread_t g_worker;
+
+/* auto-brightness controller, g_ab_active is set under g_backlight_lock
+ * and g_ab_buttons under g_buttons_lock; g_buttons_lock goes first when
+ * both are needed */
+static int g_ab_enabled = 0;
+static volatile int g_ab_active = 0;
+static volatile int g_ab_buttons = 255;
+static int g_ab_pipe[2] = { -1, -1 };
+static pthread_t g_ab_thread;
+
+/* nodes are opened on their first write, fd is -1 until then */
+#define PROP_UNOPENED   (-1)
+#define PROP_FAILED     (-2)
+
+/* overridable so the HAL can be pointed at a fake sysfs tree on the host */
+#ifndef LEDS_SYSFS_DIR
+#define LEDS_SYSFS_DIR "/sys/class/leds"
+#endif
+
 struct led_prop {
     const char *filename;
     int fd;
+#ifdef LIGHTS_STATS
+    /* write() calls and bytes written since the node was opened */
+    unsigned int writes;
+    unsigned int bytes;
+#endif
 };
 
 struct led {
@@ -53,6 +134,13 @@ struct led {
     struct led_prop period;
 };
 
+#ifdef LIGHTS_STATS
+/* nodes opened, and writes and bytes of the nodes closed since */
+static unsigned int g_stats_opens;
+static unsigned int g_stats_closed_writes;
+static unsigned int g_stats_closed_bytes;
+#endif
+
 enum {
     JOGBALL_LED,
     BUTTONS_LED,
@@ -66,31 +154,31 @@ enum {
 
 struct led leds[NUM_LEDS] = {
     [JOGBALL_LED] = {
-        .brightness = { "/sys/class/leds/jogball-backlight/brightness", 0},
-        .color = { "/sys/class/leds/jogball-backlight/color", 0},
-        .period = { "/sys/class/leds/jogball-backlight/period", 0},
+        .brightness = { LEDS_SYSFS_DIR "/jogball-backlight/brightness", -1},
+        .color = { LEDS_SYSFS_DIR "/jogball-backlight/color", -1},
+        .period = { LEDS_SYSFS_DIR "/jogball-backlight/period", -1},
     },
     [BUTTONS_LED] = {
-        .brightness = { "/sys/class/leds/button-backlight/brightness", 0},
+        .brightness = { LEDS_SYSFS_DIR "/button-backlight/brightness", -1},
     },
     [RED_LED] = {
-        .brightness = { "/sys/class/leds/red/brightness", 0},
-        .blink = { "/sys/class/leds/red/blink", 0},
+        .brightness = { LEDS_SYSFS_DIR "/red/brightness", -1},
+        .blink = { LEDS_SYSFS_DIR "/red/blink", -1},
     },
     [GREEN_LED] = {
-        .brightness = { "/sys/class/leds/green/brightness", 0},
-        .blink = { "/sys/class/leds/green/blink", 0},
+        .brightness = { LEDS_SYSFS_DIR "/green/brightness", -1},
+        .blink = { LEDS_SYSFS_DIR "/green/blink", -1},
     },
     [BLUE_LED] = {
-        .brightness = { "/sys/class/leds/blue/brightness", 0},
-        .blink = { "/sys/class/leds/blue/blink", 0},
+        .brightness = { LEDS_SYSFS_DIR "/blue/brightness", -1},
+        .blink = { LEDS_SYSFS_DIR "/blue/blink", -1},
     },
     [AMBER_LED] = {
-        .brightness = { "/sys/class/leds/amber/brightness", 0},
-        .blink = { "/sys/class/leds/amber/blink", 0},
+        .brightness = { LEDS_SYSFS_DIR "/amber/brightness", -1},
+        .blink = { LEDS_SYSFS_DIR "/amber/blink", -1},
     },
     [LCD_BACKLIGHT] = {
-        .brightness = { "/sys/class/leds/lcd-backlight/brightness", 0},
+        .brightness = { LEDS_SYSFS_DIR "/lcd-backlight/brightness", -1},
     },
 };
 
@@ -112,71 +200,107 @@ enum {
  * device methods
  */
 
-static int init_prop(struct led_prop *prop)
+static int open_prop(struct led_prop *prop)
 {
     int fd;
 
-    prop->fd = -1;
     if (!prop->filename)
-        return 0;
+        return -1;
+    if (prop->fd != PROP_UNOPENED)
+        return prop->fd;
+
     fd = open(prop->filename, O_RDWR);
     if (fd < 0) {
-        LOGE("init_prop: %s cannot be opened (%s)\n", prop->filename,
+        /* only complain once, the node won't appear later */
+        LOGE("open_prop: %s cannot be opened (%s)\n", prop->filename,
              strerror(errno));
-        return -errno;
+        prop->fd = PROP_FAILED;
+        return -1;
     }
 
+#ifdef LIGHTS_STATS
+    g_stats_opens++;
+#endif
     prop->fd = fd;
-    return 0;
+    return fd;
 }
 
 static void close_prop(struct led_prop *prop)
 {
-    int fd;
-
-    if (prop->fd > 0)
+#ifdef LIGHTS_STATS
+    if (prop->writes) {
+        LOGI("%s: %u writes, %u bytes\n", prop->filename,
+             prop->writes, prop->bytes);
+    }
+    g_stats_closed_writes += prop->writes;
+    g_stats_closed_bytes += prop->bytes;
+    prop->writes = prop->bytes = 0;
+#endif
+    if (prop->filename && prop->fd >= 0)
         close(prop->fd);
-    return;
+    prop->fd = PROP_UNOPENED;
 }
 
-void init_globals(void)
-{
-    int i;
-    pthread_mutex_init(&g_lock, NULL);
+static void init_async(void);
+static void deinit_async(void);
+static void init_auto_brightness(void);
+static void deinit_auto_brightness(void);
+static void wake_auto_brightness(void);
 
-    for (i = 0; i < NUM_LEDS; ++i) {
-        init_prop(&leds[i].brightness);
-        init_prop(&leds[i].blink);
-        init_prop(&leds[i].mode);
-	init_prop(&leds[i].color);
-        init_prop(&leds[i].period);
-    }
+static void init_globals(void)
+{
     g_attention = malloc(sizeof(struct light_state_t));
     memset(g_attention, 0, sizeof(*g_attention));
     g_notify = malloc(sizeof(struct light_state_t));
     memset(g_notify, 0, sizeof(*g_notify));
+    init_async();
+    init_auto_brightness();
+}
+
+static void deinit_globals(void)
+{
+    int i;
+
+    /* stop the threads first, they may still be writing to the nodes */
+    deinit_async();
+    deinit_auto_brightness();
+
+    for (i = 0; i < NUM_LEDS; ++i) {
+        close_prop(&leds[i].brightness);
+        close_prop(&leds[i].blink);
+        close_prop(&leds[i].mode);
+        close_prop(&leds[i].color);
+        close_prop(&leds[i].period);
+    }
+    free(g_attention);
+    g_attention = NULL;
+    free(g_notify);
+    g_notify = NULL;
 }
 
 static int
-write_int(struct led_prop *prop, int value)
+write_prop(struct led_prop *prop, char const *buffer, int bytes)
 {
-    char buffer[20];
-    int bytes;
+    int fd = open_prop(prop);
     int amt;
 
-    if (prop->fd < 0)
+    if (fd < 0)
         return 0;
 
-    LOGV("%s %s: 0x%x\n", __func__, prop->filename, value);
-
-    bytes = snprintf(buffer, sizeof(buffer), "%d\n", value);
     while (bytes > 0) {
-        amt = write(prop->fd, buffer, bytes);
+        amt = write(fd, buffer, bytes);
+#ifdef LIGHTS_STATS
+        prop->writes++;
+#endif
         if (amt < 0) {
             if (errno == EINTR)
                 continue;
             return -errno;
         }
+#ifdef LIGHTS_STATS
+        prop->bytes += amt;
+#endif
+        buffer += amt;
         bytes -= amt;
     }
 
@@ -184,30 +308,28 @@ write_int(struct led_prop *prop, int value)
 }
 
 static int
-write_rgb(struct led_prop *prop, int red, int green, int blue)
+write_int(struct led_prop *prop, int value)
 {
     char buffer[20];
     int bytes;
-    int amt;
 
-    if (prop->fd < 0)
-        return 0;
+    LOGV("%s %s: 0x%x\n", __func__, prop->filename, value);
+
+    bytes = snprintf(buffer, sizeof(buffer), "%d\n", value);
+    return write_prop(prop, buffer, bytes);
+}
+
+static int
+write_rgb(struct led_prop *prop, int red, int green, int blue)
+{
+    char buffer[20];
+    int bytes;
 
     LOGV("%s %s: red:%d green:%d blue:%d\n",
           __func__, prop->filename, red, green, blue);
 
     bytes = snprintf(buffer, sizeof(buffer), "%d %d %d\n", red, green, blue);
-    while (bytes > 0) {
-        amt = write(prop->fd, buffer, bytes);
-        if (amt < 0) {
-            if (errno == EINTR)
-                continue;
-            return -errno;
-        }
-        bytes -= amt;
-    }
-
-    return 0;
+    return write_prop(prop, buffer, bytes);
 }
 
 static unsigned int
@@ -323,10 +445,23 @@ set_light_backlight(struct light_device_t* dev,
     int brightness = rgb_to_brightness(state);
     LOGV("%s brightness=%d color=0x%08x",
             __func__,brightness, state->color);
-    pthread_mutex_lock(&g_lock);
+    pthread_mutex_lock(&g_backlight_lock);
     g_backlight = brightness;
+    if (g_ab_enabled) {
+        int active = brightness > 0 &&
+                state->brightnessMode == BRIGHTNESS_MODE_SENSOR;
+        if (active != g_ab_active) {
+            g_ab_active = active;
+            wake_auto_brightness();
+        }
+        if (active) {
+            /* the controller owns the panel while in sensor mode */
+            pthread_mutex_unlock(&g_backlight_lock);
+            return 0;
+        }
+    }
     err = write_int(&leds[LCD_BACKLIGHT].brightness, brightness);
-    pthread_mutex_unlock(&g_lock);
+    pthread_mutex_unlock(&g_backlight_lock);
     return err;
 }
 
@@ -344,10 +479,16 @@ set_light_buttons(struct light_device_t* dev,
 {
     int err = 0;
     int on = is_lit(state);
-    pthread_mutex_lock(&g_lock);
+    int value = 0;
+    pthread_mutex_lock(&g_buttons_lock);
     g_buttons = on;
-    err = write_int(&leds[BUTTONS_LED].brightness, on?255:0);
-    pthread_mutex_unlock(&g_lock);
+    if (on) {
+        pthread_mutex_lock(&g_backlight_lock);
+        value = g_ab_active ? g_ab_buttons : 255;
+        pthread_mutex_unlock(&g_backlight_lock);
+    }
+    err = write_int(&leds[BUTTONS_LED].brightness, value);
+    pthread_mutex_unlock(&g_buttons_lock);
     return err;
 }
 
@@ -433,11 +574,11 @@ static int
 set_light_battery(struct light_device_t* dev,
         struct light_state_t const* state)
 {
-    pthread_mutex_lock(&g_lock);
+    pthread_mutex_lock(&g_battery_lock);
     LOGV("%s mode=%d color=0x%08x",
             __func__,state->flashMode, state->color);
     set_speaker_light_locked(dev, state);
-    pthread_mutex_unlock(&g_lock);
+    pthread_mutex_unlock(&g_battery_lock);
     return 0;
 }
 
@@ -445,7 +586,7 @@ static int
 set_light_notifications(struct light_device_t* dev,
         struct light_state_t const* state)
 {
-    pthread_mutex_lock(&g_lock);
+    pthread_mutex_lock(&g_trackball_lock);
 
     LOGV("%s mode=%d color=0x%08x On=%d Off=%d\n",
             __func__,state->flashMode, state->color,
@@ -500,7 +641,7 @@ set_light_notifications(struct light_device_t* dev,
     }
     handle_trackball_light_locked(LIGHT_NOTIFY);
 
-    pthread_mutex_unlock(&g_lock);
+    pthread_mutex_unlock(&g_trackball_lock);
     return 0;
 }
 
@@ -513,7 +654,7 @@ set_light_attention(struct light_device_t* dev,
     LOGV("%s color=0x%08x mode=0x%08x submode=0x%08x",
             __func__, state->color, state->flashMode, state->flashOnMS);
 
-    pthread_mutex_lock(&g_lock);
+    pthread_mutex_lock(&g_trackball_lock);
     /* tune color for hardware*/
     switch (state->color & 0x00FFFFFF) {
         case RGB_WHITE:
@@ -537,23 +678,444 @@ set_light_attention(struct light_device_t* dev,
     g_attention->flashOffMS = 0;
     handle_trackball_light_locked(LIGHT_ATTENTION);
 
-    pthread_mutex_unlock(&g_lock);
+    pthread_mutex_unlock(&g_trackball_lock);
     return 0;
 }
 
 
-/** Close the lights device */
+/******************************************************************************/
+
+/**
+ * async mode
+ */
+
+static int (*const mailbox_handlers[NUM_MAILBOXES])(struct light_device_t* dev,
+        struct light_state_t const* state) = {
+    [MAILBOX_BACKLIGHT] = set_light_backlight,
+    [MAILBOX_BUTTONS] = set_light_buttons,
+    [MAILBOX_BATTERY] = set_light_battery,
+    [MAILBOX_NOTIFICATIONS] = set_light_notifications,
+    [MAILBOX_ATTENTION] = set_light_attention,
+};
+
+static void
+read_mailbox(struct light_mailbox *mb, struct light_state_t *state)
+{
+    int32_t seq;
+
+    do {
+        seq = mb->seq;
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        *state = mb->state;
+        /* the no-op exchange fails if a writer got in while we copied */
+    } while ((seq & 1) || android_atomic_cmpxchg(seq, seq, &mb->seq));
+}
+
+static void*
+lights_worker(void *arg)
+{
+    struct light_state_t state;
+    char buf[16];
+    int n, i;
+
+    do {
+        n = read(g_worker_pipe[0], buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGE("%s: read failed (%s)\n", __func__, strerror(errno));
+            break;
+        }
+        /* on EOF, still flush what was posted before the last close */
+        for (i = 0; i < NUM_MAILBOXES; i++) {
+            /* clear before reading so a concurrent post re-arms the wakeup */
+            if (!android_atomic_and(0, &g_mailboxes[i].pending))
+                continue;
+            read_mailbox(&g_mailboxes[i], &state);
+            mailbox_handlers[i](NULL, &state);
+        }
+    } while (n != 0);
+    return NULL;
+}
+
+static void
+init_async(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get(LIGHTS_ASYNC_PROPERTY, value, "0");
+    if (strcmp(value, "1"))
+        return;
+
+    if (pipe(g_worker_pipe) < 0) {
+        LOGE("%s: pipe failed (%s)\n", __func__, strerror(errno));
+        return;
+    }
+    fcntl(g_worker_pipe[1], F_SETFL, O_NONBLOCK);
+
+    if (pthread_create(&g_worker, NULL, lights_worker, NULL)) {
+        LOGE("%s: cannot start worker thread\n", __func__);
+        close(g_worker_pipe[0]);
+        close(g_worker_pipe[1]);
+        g_worker_pipe[0] = g_worker_pipe[1] = -1;
+        return;
+    }
+    g_async = 1;
+}
+
+static void
+deinit_async(void)
+{
+    if (!g_async)
+        return;
+
+    /* closing the write end makes the worker flush and exit */
+    close(g_worker_pipe[1]);
+    pthread_join(g_worker, NULL);
+    close(g_worker_pipe[0]);
+    g_worker_pipe[0] = g_worker_pipe[1] = -1;
+    g_async = 0;
+}
+
 static int
-close_lights(struct light_device_t *dev)
+post_light_state(struct light_device_t* dev,
+        struct light_state_t const* state)
 {
-    int i;
+    struct light_context_t *ctx = (struct light_context_t *)dev;
+    struct light_mailbox *mb = &g_mailboxes[ctx->mailbox];
+    int32_t seq;
+
+    /* writers of the same light take turns by making the sequence odd */
+    do {
+        seq = mb->seq;
+    } while ((seq & 1) || android_atomic_cmpxchg(seq, seq + 1, &mb->seq));
+    mb->state = *state;
+    android_atomic_inc(&mb->seq);
+
+    /* only the first post since the worker last looked needs to wake it,
+     * later ones just overwrite the state it is about to apply */
+    if (!android_atomic_or(1, &mb->pending)) {
+        char c = 0;
+        if (write(g_worker_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+            LOGE("%s: cannot wake worker (%s)\n", __func__, strerror(errno));
+    }
+    return 0;
+}
 
-    for (i = 0; i < NUM_LEDS; ++i) {
-        close_prop(&leds[i].brightness);
-        close_prop(&leds[i].blink);
-        close_prop(&leds[i].mode);
+
+/******************************************************************************/
+
+/**
+ * auto-brightness
+ */
+
+#define LIGHTSENSOR_DEVICE      "/dev/lightsensor"
+#define LIGHTSENSOR_INPUT_NAME  "lightsensor-level"
+
+/* the driver reports a level, this is sLuxValues from libsensors */
+static const int ab_lux_values[] = {
+    10, 160, 225, 320, 640, 1280, 2600, 5800, 8000, 10240
+};
+
+/* config_autoBrightness{Levels,LcdBacklightValues,ButtonBacklightValues}
+ * from the framework overlay */
+static const int ab_levels[] = { 200, 400, 1000, 3000 };
+static const int ab_lcd_values[] = { 25, 55, 70, 70, 250 };
+static const int ab_button_values[] = { 255, 255, 0, 0, 0 };
+
+#define NUM_AB_LEVELS   (int)(sizeof(ab_levels) / sizeof(ab_levels[0]))
+
+/* a new zone has to hold this long before we act on it; going darker is
+ * slower so that passing shadows don't dim the panel */
+#define AB_BRIGHTEN_DEBOUNCE_MS 1000
+#define AB_DARKEN_DEBOUNCE_MS   4000
+/* and it only counts as new once the lux is this far past the boundary,
+ * so a reading that sits on a threshold doesn't flip the zone */
+#define AB_HYSTERESIS_PERCENT   25
+/* fades move a quarter of the remaining distance every step */
+#define AB_RAMP_STEP_MS         50
+
+static int64_t
+now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int
+open_light_input(void)
+{
+    const char *dirname = "/dev/input";
+    char devname[PATH_MAX];
+    char name[80];
+    struct dirent *de;
+    DIR *dir;
+    int fd = -1;
+
+    dir = opendir(dirname);
+    if (dir == NULL)
+        return -1;
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(devname, sizeof(devname), "%s/%s", dirname, de->d_name);
+        fd = open(devname, O_RDONLY);
+        if (fd < 0)
+            continue;
+        if (ioctl(fd, EVIOCGNAME(sizeof(name) - 1), &name) < 1)
+            name[0] = '\0';
+        if (!strcmp(name, LIGHTSENSOR_INPUT_NAME))
+            break;
+        close(fd);
+        fd = -1;
+    }
+    closedir(dir);
+
+    LOGE_IF(fd < 0, "%s: no '%s' input device\n", __func__,
+            LIGHTSENSOR_INPUT_NAME);
+    return fd;
+}
+
+/* returns 1 if we turned the sensor on, and so must turn it off again */
+static int
+enable_light_sensor(int enable, int owned)
+{
+    int fd, flags;
+
+    if (!enable && !owned)
+        return 0;
+
+    fd = open(LIGHTSENSOR_DEVICE, O_RDONLY);
+    if (fd < 0) {
+        LOGE("%s: cannot open %s (%s)\n", __func__, LIGHTSENSOR_DEVICE,
+             strerror(errno));
+        return 0;
+    }
+    if (enable) {
+        /* leave it alone if an application already has it running */
+        if (!ioctl(fd, LIGHTSENSOR_IOCTL_GET_ENABLED, &flags) && flags) {
+            owned = 0;
+        } else {
+            flags = 1;
+            owned = !ioctl(fd, LIGHTSENSOR_IOCTL_ENABLE, &flags);
+        }
+    } else if (owned) {
+        flags = 0;
+        ioctl(fd, LIGHTSENSOR_IOCTL_ENABLE, &flags);
+        owned = 0;
+    }
+    close(fd);
+    return owned;
+}
+
+/* maps a level to a zone, sticking to the current zone (if any) unless
+ * the lux is clear of its boundaries */
+static int
+lux_to_zone(int level, int current)
+{
+    int lux, zone;
+
+    if (level < 0)
+        level = 0;
+    if (level >= (int)(sizeof(ab_lux_values) / sizeof(ab_lux_values[0])))
+        level = sizeof(ab_lux_values) / sizeof(ab_lux_values[0]) - 1;
+    lux = ab_lux_values[level];
+
+    if (current < 0) {
+        for (zone = 0; zone < NUM_AB_LEVELS; zone++) {
+            if (lux < ab_levels[zone])
+                break;
+        }
+        return zone;
+    }
+
+    zone = current;
+    while (zone < NUM_AB_LEVELS &&
+            lux * 100 >= ab_levels[zone] * (100 + AB_HYSTERESIS_PERCENT))
+        zone++;
+    if (zone == current) {
+        while (zone > 0 &&
+                lux * 100 < ab_levels[zone - 1] * (100 - AB_HYSTERESIS_PERCENT))
+            zone--;
+    }
+    return zone;
+}
+
+static void
+apply_auto_buttons(int value)
+{
+    pthread_mutex_lock(&g_buttons_lock);
+    g_ab_buttons = value;
+    if (g_buttons)
+        write_int(&leds[BUTTONS_LED].brightness, g_ab_buttons);
+    pthread_mutex_unlock(&g_buttons_lock);
+}
+
+static void*
+auto_brightness_thread(void *arg)
+{
+    struct pollfd fds[2];
+    struct input_event event;
+    struct input_absinfo absinfo;
+    int input_fd = open_light_input();
+    int running = 0, owned = 0;
+    int zone = -1, pending = -1;
+    int64_t pending_since = 0, next_step = 0;
+    int current = 0, target = 0;
+
+    while (1) {
+        int64_t now = now_ms();
+        int timeout = -1;
+        int active = g_ab_active;
+
+        if (active != running) {
+            owned = enable_light_sensor(active, owned);
+            running = active;
+            zone = pending = -1;
+            if (!active) {
+                /* hand the buttons back at the framework's level */
+                apply_auto_buttons(255);
+            } else {
+                current = target = g_backlight;
+                /* evdev drops repeated values, so fetch the current one */
+                if (input_fd >= 0 &&
+                        !ioctl(input_fd, EVIOCGABS(ABS_MISC), &absinfo)) {
+                    pending = lux_to_zone(absinfo.value, -1);
+                    pending_since = now;
+                }
+            }
+        }
+
+        if (running && pending >= 0) {
+            int64_t due = pending_since + (zone < 0 ? 0 :
+                    pending > zone ? AB_BRIGHTEN_DEBOUNCE_MS :
+                    AB_DARKEN_DEBOUNCE_MS);
+            if (now >= due) {
+                zone = pending;
+                pending = -1;
+                target = ab_lcd_values[zone];
+                apply_auto_buttons(ab_button_values[zone]);
+            } else {
+                timeout = due - now;
+            }
+        }
+
+        if (running && current != target) {
+            if (now >= next_step) {
+                int step = (target - current) / 4;
+                if (step == 0)
+                    step = target > current ? 1 : -1;
+                current += step;
+                pthread_mutex_lock(&g_backlight_lock);
+                if (g_ab_active)
+                    write_int(&leds[LCD_BACKLIGHT].brightness, current);
+                pthread_mutex_unlock(&g_backlight_lock);
+                next_step = now + AB_RAMP_STEP_MS;
+            }
+            if (current != target &&
+                    (timeout < 0 || next_step - now < timeout))
+                timeout = next_step - now;
+        }
+
+        fds[0].fd = g_ab_pipe[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = running ? input_fd : -1;
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGE("%s: poll failed (%s)\n", __func__, strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents) {
+            char buf[16];
+            /* EOF means the module is going away */
+            if (read(g_ab_pipe[0], buf, sizeof(buf)) == 0)
+                break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            if (read(input_fd, &event, sizeof(event)) == sizeof(event) &&
+                    event.type == EV_ABS && event.code == ABS_MISC) {
+                int z = lux_to_zone(event.value, zone);
+                if (z == zone) {
+                    pending = -1;
+                } else if (z != pending) {
+                    pending = z;
+                    pending_since = now_ms();
+                }
+            }
+        }
     }
 
+    enable_light_sensor(0, owned);
+    if (input_fd >= 0)
+        close(input_fd);
+    return NULL;
+}
+
+static void
+wake_auto_brightness(void)
+{
+    char c = 0;
+    if (write(g_ab_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+        LOGE("%s: cannot wake controller (%s)\n", __func__, strerror(errno));
+}
+
+static void
+init_auto_brightness(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get(AUTO_BRIGHTNESS_PROPERTY, value, "0");
+    if (strcmp(value, "1"))
+        return;
+
+    if (pipe(g_ab_pipe) < 0) {
+        LOGE("%s: pipe failed (%s)\n", __func__, strerror(errno));
+        return;
+    }
+    fcntl(g_ab_pipe[1], F_SETFL, O_NONBLOCK);
+
+    if (pthread_create(&g_ab_thread, NULL, auto_brightness_thread, NULL)) {
+        LOGE("%s: cannot start controller thread\n", __func__);
+        close(g_ab_pipe[0]);
+        close(g_ab_pipe[1]);
+        g_ab_pipe[0] = g_ab_pipe[1] = -1;
+        return;
+    }
+    g_ab_enabled = 1;
+}
+
+static void
+deinit_auto_brightness(void)
+{
+    if (!g_ab_enabled)
+        return;
+
+    close(g_ab_pipe[1]);
+    pthread_join(g_ab_thread, NULL);
+    close(g_ab_pipe[0]);
+    g_ab_pipe[0] = g_ab_pipe[1] = -1;
+    g_ab_enabled = 0;
+    g_ab_active = 0;
+}
+
+
+/** Close the lights device */
+static int
+close_lights(struct light_device_t *dev)
+{
+    pthread_mutex_lock(&g_init_lock);
+    if (--g_refs == 0)
+        deinit_globals();
+    pthread_mutex_unlock(&g_init_lock);
+
     if (dev) {
         free(dev);
     }
@@ -573,40 +1135,54 @@ static int open_lights(const struct hw_module_t* module, char const* name,
 {
     int (*set_light)(struct light_device_t* dev,
             struct light_state_t const* state);
+    int mailbox = -1;
 
     if (0 == strcmp(LIGHT_ID_BACKLIGHT, name)) {
         set_light = set_light_backlight;
+        mailbox = MAILBOX_BACKLIGHT;
     }
     else if (0 == strcmp(LIGHT_ID_KEYBOARD, name)) {
         set_light = set_light_keyboard;
     }
     else if (0 == strcmp(LIGHT_ID_BUTTONS, name)) {
         set_light = set_light_buttons;
+        mailbox = MAILBOX_BUTTONS;
     }
     else if (0 == strcmp(LIGHT_ID_BATTERY, name)) {
         set_light = set_light_battery;
+        mailbox = MAILBOX_BATTERY;
     }
     else if (0 == strcmp(LIGHT_ID_NOTIFICATIONS, name)) {
         set_light = set_light_notifications;
+        mailbox = MAILBOX_NOTIFICATIONS;
     }
     else if (0 == strcmp(LIGHT_ID_ATTENTION, name)) {
         set_light = set_light_attention;
+        mailbox = MAILBOX_ATTENTION;
     }
     else {
         return -EINVAL;
     }
 
-    pthread_once(&g_init, init_globals);
+    pthread_mutex_lock(&g_init_lock);
+    if (g_refs++ == 0)
+        init_globals();
+    pthread_mutex_unlock(&g_init_lock);
 
-    struct light_device_t *dev = malloc(sizeof(struct light_device_t));
-    memset(dev, 0, sizeof(*dev));
+    struct light_context_t *ctx = malloc(sizeof(struct light_context_t));
+    memset(ctx, 0, sizeof(*ctx));
 
+    struct light_device_t *dev = &ctx->device;
     dev->common.tag = HARDWARE_DEVICE_TAG;
     dev->common.version = 0;
     dev->common.module = (struct hw_module_t*)module;
     dev->common.close = (int (*)(struct hw_device_t*))close_lights;
     dev->set_light = set_light;
 
+    ctx->mailbox = mailbox;
+    if (g_async && mailbox >= 0)
+        dev->set_light = post_light_state;
+
     *device = (struct hw_device_t*)dev;
     return 0;
 }
@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * lights_test: runs the lights HAL on the host against a fake sysfs tree
+ * in a temporary directory of its own, replays scripted state sequences
+ * through every set_light entry point and reports the syscalls and bytes
+ * each one costs, then times backlight fades in sync and async mode.
+ *
+ * Built with LIGHTS_STATS; the HAL is compiled in so the counters and the
+ * property lookups are reachable.
+ */
+
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#define property_get lights_test_property_get
+#include "../lights.c"
+#undef property_get
+
+#define FADES           200     /* 255 -> 0 -> 255 round trips per run */
+
+static int g_test_async;
+
+int lights_test_property_get(const char *key, char *value,
+        const char *default_value)
+{
+    const char *v = default_value ? default_value : "";
+
+    if (!strcmp(key, LIGHTS_ASYNC_PROPERTY) && g_test_async)
+        v = "1";
+    strcpy(value, v);
+    return strlen(value);
+}
+
+/******************************************************************************/
+
+enum {
+    TEST_BACKLIGHT,
+    TEST_KEYBOARD,
+    TEST_BUTTONS,
+    TEST_BATTERY,
+    TEST_NOTIFICATIONS,
+    TEST_ATTENTION,
+    NUM_TEST_LIGHTS,
+};
+
+static const char *const sLightNames[NUM_TEST_LIGHTS] = {
+    [TEST_BACKLIGHT] = LIGHT_ID_BACKLIGHT,
+    [TEST_KEYBOARD] = LIGHT_ID_KEYBOARD,
+    [TEST_BUTTONS] = LIGHT_ID_BUTTONS,
+    [TEST_BATTERY] = LIGHT_ID_BATTERY,
+    [TEST_NOTIFICATIONS] = LIGHT_ID_NOTIFICATIONS,
+    [TEST_ATTENTION] = LIGHT_ID_ATTENTION,
+};
+
+static struct light_device_t *g_devices[NUM_TEST_LIGHTS];
+
+struct step {
+    int light;
+    unsigned int color;
+    int flashMode;
+    int flashOnMS;
+    int flashOffMS;
+};
+
+struct script {
+    const char *name;
+    const struct step *steps;
+    int count;
+};
+
+#define SCRIPT(name, steps) { name, steps, sizeof(steps) / sizeof(steps[0]) }
+
+static const struct step sBacklight[] = {
+    { TEST_BACKLIGHT, 0xffffffff, 0, 0, 0 },
+    { TEST_BACKLIGHT, 0xff464646, 0, 0, 0 },
+    { TEST_BACKLIGHT, 0xff191919, 0, 0, 0 },
+    { TEST_BACKLIGHT, 0xff000000, 0, 0, 0 },
+};
+
+static const struct step sKeyboard[] = {
+    { TEST_KEYBOARD, 0xffffffff, 0, 0, 0 },
+    { TEST_KEYBOARD, 0xff000000, 0, 0, 0 },
+};
+
+static const struct step sButtons[] = {
+    { TEST_BUTTONS, 0xffffffff, 0, 0, 0 },
+    { TEST_BUTTONS, 0xff000000, 0, 0, 0 },
+    { TEST_BUTTONS, 0xffffffff, 0, 0, 0 },
+    { TEST_BUTTONS, 0xff000000, 0, 0, 0 },
+};
+
+/* plugged in, charged, unplugged low, back to nothing */
+static const struct step sBattery[] = {
+    { TEST_BATTERY, RGB_AMBER, LIGHT_FLASH_NONE, 0, 0 },
+    { TEST_BATTERY, RGB_GREEN, LIGHT_FLASH_NONE, 0, 0 },
+    { TEST_BATTERY, RGB_BLACK, LIGHT_FLASH_NONE, 0, 0 },
+    { TEST_BATTERY, RGB_RED, LIGHT_FLASH_TIMED, 125, 2875 },
+    { TEST_BATTERY, RGB_BLACK, LIGHT_FLASH_TIMED, 0, 0 },
+};
+
+static const struct step sNotifications[] = {
+    { TEST_NOTIFICATIONS, RGB_WHITE, LIGHT_FLASH_TIMED, 500, 2000 },
+    { TEST_NOTIFICATIONS, RGB_WHITE, LIGHT_FLASH_TIMED, 500, 2000 },
+    { TEST_NOTIFICATIONS, RGB_PINK, LIGHT_FLASH_TIMED, 500, 4500 },
+    { TEST_NOTIFICATIONS, RGB_GREEN, LIGHT_FLASH_NONE, 0, 0 },
+    { TEST_NOTIFICATIONS, RGB_BLACK, LIGHT_FLASH_NONE, 0, 0 },
+};
+
+/* an incoming call pulses over a pending notification, then hands back */
+static const struct step sAttention[] = {
+    { TEST_NOTIFICATIONS, RGB_GREEN, LIGHT_FLASH_TIMED, 500, 2000 },
+    { TEST_ATTENTION, RGB_WHITE, LIGHT_FLASH_HARDWARE, 7, 0 },
+    { TEST_ATTENTION, RGB_BLUE, LIGHT_FLASH_HARDWARE, 7, 0 },
+    { TEST_ATTENTION, RGB_BLACK, LIGHT_FLASH_NONE, 0, 0 },
+    { TEST_NOTIFICATIONS, RGB_BLACK, LIGHT_FLASH_NONE, 0, 0 },
+};
+
+static const struct script sScripts[] = {
+    SCRIPT("backlight", sBacklight),
+    SCRIPT("keyboard", sKeyboard),
+    SCRIPT("buttons", sButtons),
+    SCRIPT("battery", sBattery),
+    SCRIPT("notifications", sNotifications),
+    SCRIPT("attention", sAttention),
+};
+
+#define NUM_SCRIPTS (int)(sizeof(sScripts) / sizeof(sScripts[0]))
+
+/******************************************************************************/
+
+struct counts {
+    unsigned int opens;
+    unsigned int writes;
+    unsigned int bytes;
+};
+
+static void get_counts(struct counts *c)
+{
+    int i, j;
+
+    c->opens = g_stats_opens;
+    c->writes = g_stats_closed_writes;
+    c->bytes = g_stats_closed_bytes;
+    for (i = 0; i < NUM_LEDS; i++) {
+        struct led_prop *props[] = {
+            &leds[i].mode, &leds[i].brightness, &leds[i].blink,
+            &leds[i].color, &leds[i].period,
+        };
+        for (j = 0; j < 5; j++) {
+            c->writes += props[j]->writes;
+            c->bytes += props[j]->bytes;
+        }
+    }
+}
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int mkdirs(const char *path)
+{
+    char dir[PATH_MAX];
+    char *p;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (p = dir + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+            return -1;
+        *p = '/';
+    }
+    return 0;
+}
+
+/* the fake sysfs tree, removed again on exit */
+static char g_root[] = "/tmp/lights_test.XXXXXX";
+
+static void remove_root(void)
+{
+    char dir[PATH_MAX];
+    int i, j;
+
+    for (i = 0; i < NUM_LEDS; i++) {
+        struct led_prop *props[] = {
+            &leds[i].mode, &leds[i].brightness, &leds[i].blink,
+            &leds[i].color, &leds[i].period,
+        };
+        for (j = 0; j < 5; j++) {
+            if (!props[j]->filename)
+                continue;
+            unlink(props[j]->filename);
+            snprintf(dir, sizeof(dir), "%s", props[j]->filename);
+            rmdir(dirname(dir));
+        }
+    }
+    snprintf(dir, sizeof(dir), "%s/leds", g_root);
+    rmdir(dir);
+    rmdir(g_root);
+}
+
+/* points every node of the leds[] table into a new temporary directory */
+static int make_root(void)
+{
+    char path[PATH_MAX];
+    int i, j;
+
+    if (!mkdtemp(g_root))
+        return -1;
+    atexit(remove_root);
+
+    for (i = 0; i < NUM_LEDS; i++) {
+        struct led_prop *props[] = {
+            &leds[i].mode, &leds[i].brightness, &leds[i].blink,
+            &leds[i].color, &leds[i].period,
+        };
+        for (j = 0; j < 5; j++) {
+            if (!props[j]->filename)
+                continue;
+            snprintf(path, sizeof(path), "%s/leds%s", g_root,
+                     props[j]->filename + strlen(LEDS_SYSFS_DIR));
+            props[j]->filename = strdup(path);
+            if (!props[j]->filename)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* creates (or empties) every node the leds[] table refers to */
+static int make_sysfs(void)
+{
+    int i, j, fd;
+
+    for (i = 0; i < NUM_LEDS; i++) {
+        struct led_prop *props[] = {
+            &leds[i].mode, &leds[i].brightness, &leds[i].blink,
+            &leds[i].color, &leds[i].period,
+        };
+        for (j = 0; j < 5; j++) {
+            if (!props[j]->filename)
+                continue;
+            if (mkdirs(props[j]->filename) < 0)
+                return -1;
+            fd = open(props[j]->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                return -1;
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+/*
+ * The value the HAL wrote last, -1 if none. Writes append to the fake
+ * node, so make_sysfs() has to empty it before a run reopens it.
+ */
+static int last_value(const char *filename)
+{
+    char buf[32];
+    char *line;
+    struct stat st;
+    off_t off;
+    int fd, n;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    off = st.st_size > (off_t)sizeof(buf) - 1 ?
+            st.st_size - (off_t)sizeof(buf) + 1 : 0;
+    n = pread(fd, buf, sizeof(buf) - 1, off);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    while (n > 0 && buf[n - 1] == '\n')
+        buf[--n] = '\0';
+    line = strrchr(buf, '\n');
+    return atoi(line ? line + 1 : buf);
+}
+
+static int open_devices(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_TEST_LIGHTS; i++) {
+        if (HAL_MODULE_INFO_SYM.methods->open(&HAL_MODULE_INFO_SYM,
+                sLightNames[i], (struct hw_device_t **)&g_devices[i])) {
+            fprintf(stderr, "cannot open %s\n", sLightNames[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void close_devices(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_TEST_LIGHTS; i++) {
+        if (g_devices[i])
+            g_devices[i]->common.close(&g_devices[i]->common);
+        g_devices[i] = NULL;
+    }
+}
+
+static void run_script(const struct script *script)
+{
+    struct light_state_t state;
+    struct counts before, after;
+    int i, syscalls, ops = script->count;
+
+    get_counts(&before);
+    for (i = 0; i < ops; i++) {
+        const struct step *step = &script->steps[i];
+        struct light_device_t *dev = g_devices[step->light];
+        memset(&state, 0, sizeof(state));
+        state.color = step->color;
+        state.flashMode = step->flashMode;
+        state.flashOnMS = step->flashOnMS;
+        state.flashOffMS = step->flashOffMS;
+        dev->set_light(dev, &state);
+    }
+    get_counts(&after);
+
+    syscalls = (after.opens - before.opens) + (after.writes - before.writes);
+    printf("%-14s %4d %9d %7u %7u %9.2f %9.2f\n", script->name, ops,
+           syscalls, after.writes - before.writes, after.bytes - before.bytes,
+           (double)syscalls / ops, (double)(after.bytes - before.bytes) / ops);
+}
+
+/* returns the number of updates issued, -1 on error */
+static int run_fade(int async, int64_t *elapsed_us, struct counts *cost)
+{
+    struct light_device_t *dev;
+    struct light_state_t state;
+    struct counts before, after;
+    int64_t start;
+    int updates = 0;
+    int i, level;
+
+    g_test_async = async;
+    get_counts(&before);
+    if (HAL_MODULE_INFO_SYM.methods->open(&HAL_MODULE_INFO_SYM,
+            LIGHT_ID_BACKLIGHT, (struct hw_device_t **)&dev))
+        return -1;
+
+    memset(&state, 0, sizeof(state));
+    start = now_us();
+    for (i = 0; i < FADES; i++) {
+        for (level = 255; level >= 0; level--, updates++) {
+            state.color = 0xff000000 | (level * 0x010101);
+            dev->set_light(dev, &state);
+        }
+        for (level = 1; level <= 255; level++, updates++) {
+            state.color = 0xff000000 | (level * 0x010101);
+            dev->set_light(dev, &state);
+        }
+    }
+    /* the last close flushes the async worker */
+    dev->common.close(&dev->common);
+    *elapsed_us = now_us() - start;
+
+    get_counts(&after);
+    cost->opens = after.opens - before.opens;
+    cost->writes = after.writes - before.writes;
+    cost->bytes = after.bytes - before.bytes;
+    g_test_async = 0;
+    return updates;
+}
+
+int main(int argc, char **argv)
+{
+    const char *lcd;
+    int failures = 0;
+    int async, i;
+
+    if (make_root() < 0 || make_sysfs() < 0) {
+        fprintf(stderr, "cannot create the fake sysfs tree under %s (%s)\n",
+                g_root, strerror(errno));
+        return 1;
+    }
+    lcd = leds[LCD_BACKLIGHT].brightness.filename;
+
+    printf("%-14s %4s %9s %7s %7s %9s %9s\n", "script", "ops", "syscalls",
+           "writes", "bytes", "calls/op", "bytes/op");
+    if (open_devices() < 0)
+        return 1;
+    for (i = 0; i < NUM_SCRIPTS; i++)
+        run_script(&sScripts[i]);
+    close_devices();
+
+    if (last_value(lcd) != 0) {
+        printf("FAIL: backlight script left %s at %d\n", lcd, last_value(lcd));
+        failures++;
+    }
+
+    printf("\n%-6s %7s %9s %9s %7s %8s %10s\n", "fade", "updates", "ms",
+           "updates/s", "writes", "bytes", "us/update");
+    for (async = 0; async <= 1; async++) {
+        struct counts cost;
+        int64_t us;
+        int updates;
+
+        make_sysfs();
+        updates = run_fade(async, &us, &cost);
+
+        if (updates < 0) {
+            fprintf(stderr, "cannot open %s\n", LIGHT_ID_BACKLIGHT);
+            return 1;
+        }
+        printf("%-6s %7d %9.1f %9.0f %7u %8u %10.2f\n",
+               async ? "async" : "sync", updates, us / 1000.0,
+               us ? updates * 1000000.0 / us : 0.0,
+               cost.writes, cost.bytes, (double)us / updates);
+
+        /* both modes must land on the final level of the fade */
+        if (last_value(lcd) != 255) {
+            printf("FAIL: %s fade left %s at %d\n", async ? "async" : "sync",
+                   lcd, last_value(lcd));
+            failures++;
+        }
+        if (!async && cost.writes != (unsigned int)updates) {
+            printf("FAIL: sync fade wrote %u times for %d updates\n",
+                   cost.writes, updates);
+            failures++;
+        }
+        if (async && cost.writes > (unsigned int)updates) {
+            printf("FAIL: async fade wrote %u times for %d updates\n",
+                   cost.writes, updates);
+            failures++;
+        }
+    }
+
+    return failures ? 1 : 0;
+}
@@ -25,22 +25,29 @@
 #include <math.h>
 #include <poll.h>
 #include <pthread.h>
-#include <sys/select.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <linux/input.h>
 #include <linux/akm8973.h>
 #include <linux/capella_cm3602.h>
 #include <linux/lightsensor.h>
 
+#include <cutils/ashmem.h>
 #include <cutils/atomic.h>
+#include <cutils/atomic-inline.h>
 #include <cutils/log.h>
 #include <cutils/native_handle.h>
+#include <cutils/properties.h>
 
-#define __MAX(a,b) ((a)>=(b)?(a):(b))
+#include "sensors_direct.h"
+#include "sensors_virtual.h"
 
 /*****************************************************************************/
 
-#define MAX_NUM_SENSORS 6
+#define MAX_NUM_SENSORS 11
 
 #define SUPPORTED_SENSORS  ((1<<MAX_NUM_SENSORS)-1)
 
@@ -52,6 +59,11 @@
 #define ID_T  (3)
 #define ID_P  (4)
 #define ID_L  (5)
+#define ID_R  (6)
+#define ID_SK (7)
+#define ID_DT (8)
+#define ID_FL (9)
+#define ID_PU (10)
 
 static int id_to_sensor[MAX_NUM_SENSORS] = {
     [ID_A] = SENSOR_TYPE_ACCELEROMETER,
@@ -60,6 +72,11 @@ static int id_to_sensor[MAX_NUM_SENSORS] = {
     [ID_T] = SENSOR_TYPE_TEMPERATURE,
     [ID_P] = SENSOR_TYPE_PROXIMITY,
     [ID_L] = SENSOR_TYPE_LIGHT,
+    [ID_R] = SENSOR_TYPE_SCREEN_ORIENTATION,
+    [ID_SK] = SENSOR_TYPE_SHAKE,
+    [ID_DT] = SENSOR_TYPE_DOUBLE_TAP,
+    [ID_FL] = SENSOR_TYPE_FLIP,
+    [ID_PU] = SENSOR_TYPE_PICK_UP,
 };
 
 #define SENSORS_AKM_ACCELERATION   (1<<ID_A)
@@ -74,6 +91,19 @@ static int id_to_sensor[MAX_NUM_SENSORS] = {
 #define SENSORS_LIGHT              (1<<ID_L)
 #define SENSORS_LIGHT_GROUP        (1<<ID_L)
 
+#define SENSORS_HARDWARE           (SENSORS_AKM_GROUP|SENSORS_CM_GROUP|SENSORS_LIGHT_GROUP)
+
+#define SENSORS_ROTATION           (1<<ID_R)
+#define SENSORS_SHAKE              (1<<ID_SK)
+#define SENSORS_DOUBLE_TAP         (1<<ID_DT)
+#define SENSORS_FLIP               (1<<ID_FL)
+#define SENSORS_PICK_UP            (1<<ID_PU)
+#define SENSORS_GESTURES           (SENSORS_SHAKE|SENSORS_DOUBLE_TAP|SENSORS_FLIP|SENSORS_PICK_UP)
+
+// reported when the value changes or the event happens, whatever rate the
+// client asked for: dropping one would lose it, not just thin a stream
+#define SENSORS_ON_CHANGE          (SENSORS_AKM_TEMPERATURE|SENSORS_ROTATION|SENSORS_GESTURES)
+
 /*****************************************************************************/
 
 struct sensors_control_context_t {
@@ -82,15 +112,28 @@ struct sensors_control_context_t {
     int cmd_fd;
     int lsd_fd;
     uint32_t active_sensors;
+    uint32_t requested_sensors;
+    int32_t delay_ms;
+    int throttled;
 };
 
 struct sensors_data_context_t {
     struct sensors_data_device_t device; // must be first
-    int events_fd[3];
+    struct sensors_data_context_t *next;
+    int opened;
+    uint32_t mask;
+    int64_t delay_ns;
+    int64_t last_time[MAX_NUM_SENSORS];
+    pthread_cond_t cond;
+    int wake;
     sensors_data_t sensors[MAX_NUM_SENSORS];
     uint32_t pendingSensors;
 };
 
+struct sensors_direct_context_t {
+    struct sensors_direct_device_t device; // must be first
+};
+
 /*
  * The SENSORS Module
  */
@@ -118,6 +161,10 @@ static const struct sensor_t sSensorList[] = {
                 "Asahi Kasei",
                 1, SENSORS_HANDLE_BASE+ID_O,
                 SENSOR_TYPE_ORIENTATION, 360.0f, 1.0f, 7.0f, { } },
+        { "AK8973 Temperature sensor",
+                "Asahi Kasei",
+                1, SENSORS_HANDLE_BASE+ID_T,
+                SENSOR_TYPE_TEMPERATURE, 85.0f, 1.0f, 0.4f, { } },
         { "CM3602 Proximity sensor",
                 "Capella Microsystems",
                 1, SENSORS_HANDLE_BASE+ID_P,
@@ -128,6 +175,26 @@ static const struct sensor_t sSensorList[] = {
                 "Capella Microsystems",
                 1, SENSORS_HANDLE_BASE+ID_L,
                 SENSOR_TYPE_LIGHT, 10240.0f, 1.0f, 0.5f, { } },
+        { "Screen orientation detector",
+                "The Android Open Source Project",
+                1, SENSORS_HANDLE_BASE+ID_R,
+                SENSOR_TYPE_SCREEN_ORIENTATION, 3.0f, 1.0f, 0.2f, { } },
+        { "Shake gesture",
+                "The Android Open Source Project",
+                1, SENSORS_HANDLE_BASE+ID_SK,
+                SENSOR_TYPE_SHAKE, 1.0f, 1.0f, 0.2f, { } },
+        { "Double-tap gesture",
+                "The Android Open Source Project",
+                1, SENSORS_HANDLE_BASE+ID_DT,
+                SENSOR_TYPE_DOUBLE_TAP, 1.0f, 1.0f, 0.2f, { } },
+        { "Face-down flip gesture",
+                "The Android Open Source Project",
+                1, SENSORS_HANDLE_BASE+ID_FL,
+                SENSOR_TYPE_FLIP, 1.0f, 1.0f, 0.2f, { } },
+        { "Pick-up gesture",
+                "The Android Open Source Project",
+                1, SENSORS_HANDLE_BASE+ID_PU,
+                SENSOR_TYPE_PICK_UP, 1.0f, 1.0f, 0.2f, { } },
 };
 
 static const float sLuxValues[10] = {
@@ -218,9 +285,18 @@ const struct sensors_module_t HAL_MODULE_INFO_SYM = {
 
 /*****************************************************************************/
 
-static int open_inputs(int mode, int *akm_fd, int *p_fd, int *l_fd)
+/* input device names, in the order of the data source fds */
+static const char *const sInputDevices[3] = {
+    "compass", "proximity", "lightsensor-level",
+};
+
+/*
+ * Scans the input drivers for the devices in wanted (bits indexing
+ * sInputDevices) and stores their fds in fds[]; devices not found are left
+ * alone.
+ */
+static void find_inputs(int mode, int fds[3], uint32_t wanted)
 {
-    /* scan all input drivers and look for "compass" */
     int fd = -1;
     const char *dirname = "/dev/input";
     char devname[PATH_MAX];
@@ -229,12 +305,11 @@ static int open_inputs(int mode, int *akm_fd, int *p_fd, int *l_fd)
     struct dirent *de;
     dir = opendir(dirname);
     if(dir == NULL)
-        return -1;
+        return;
     strcpy(devname, dirname);
     filename = devname + strlen(devname);
     *filename++ = '/';
-    *akm_fd = *p_fd = -1;
-    while((de = readdir(dir))) {
+    while((de = readdir(dir)) && wanted) {
         if(de->d_name[0] == '.' &&
            (de->d_name[1] == '\0' ||
             (de->d_name[1] == '.' && de->d_name[2] == '\0')))
@@ -243,28 +318,36 @@ static int open_inputs(int mode, int *akm_fd, int *p_fd, int *l_fd)
         fd = open(devname, mode);
         if (fd>=0) {
             char name[80];
+            int i;
             if (ioctl(fd, EVIOCGNAME(sizeof(name) - 1), &name) < 1) {
                 name[0] = '\0';
             }
-            if (!strcmp(name, "compass")) {
-                LOGV("using %s (name=%s)", devname, name);
-                *akm_fd = fd;
-            }
-            else if (!strcmp(name, "proximity")) {
-                LOGV("using %s (name=%s)", devname, name);
-                *p_fd = fd;
-            }
-            else if (!strcmp(name, "lightsensor-level")) {
-                LOGV("using %s (name=%s)", devname, name);
-                *l_fd = fd;
+            for (i = 0; i < 3; i++) {
+                if ((wanted & (1<<i)) && !strcmp(name, sInputDevices[i])) {
+                    LOGV("using %s (name=%s)", devname, name);
+                    fds[i] = fd;
+                    wanted &= ~(1<<i);
+                    break;
+                }
             }
-            else
+            if (i == 3)
                 close(fd);
         }
     }
     closedir(dir);
+}
+
+static int open_inputs(int mode, int *akm_fd, int *p_fd, int *l_fd)
+{
+    /* scan all input drivers and look for "compass" */
+    int fds[3] = { -1, -1, -1 };
+    int fd = 0;
+
+    find_inputs(mode, fds, 7);
+    *akm_fd = fds[0];
+    *p_fd = fds[1];
+    *l_fd = fds[2];
 
-    fd = 0;
     if (*akm_fd < 0) {
         LOGE("Couldn't find or open 'compass' driver (%s)", strerror(errno));
         fd = -1;
@@ -511,36 +594,266 @@ static int enable_disable_ls(struct sensors_control_context_t *dev,
 
 /*****************************************************************************/
 
+/*
+ * Sensors the framework enabled through a control device in this process,
+ * or -1 if there is none. Hardware sensors that only run on behalf of a
+ * virtual sensor are not reported to the data devices.
+ */
+static volatile int32_t g_requested_sensors = -1;
+
+static uint32_t virtual_dependencies(uint32_t sensors)
+{
+    uint32_t deps = 0;
+    if (sensors & (SENSORS_ROTATION | SENSORS_GESTURES))
+        deps |= SENSORS_AKM_ACCELERATION;
+    return deps;
+}
+
+static uint32_t reported_sensors(void)
+{
+    int32_t requested = g_requested_sensors;
+    return requested < 0 ? SUPPORTED_SENSORS : (uint32_t)requested;
+}
+
 static native_handle_t* control__open_data_source(struct sensors_control_context_t *dev)
 {
     native_handle_t* handle;
-    int akm_fd, p_fd, l_fd;
+    int fds[3];
+    int i;
 
-    if (open_inputs(O_RDONLY, &akm_fd, &p_fd, &l_fd) < 0 ||
-            akm_fd < 0 || p_fd < 0 || l_fd < 0) {
+    // serve whatever is there, the reader reopens the rest when it shows up
+    if (open_inputs(O_RDONLY, &fds[0], &fds[1], &fds[2]) < 0 &&
+            fds[0] < 0 && fds[1] < 0 && fds[2] < 0) {
         return NULL;
     }
 
     handle = native_handle_create(3, 0);
-    handle->data[0] = akm_fd;
-    handle->data[1] = p_fd;
-    handle->data[2] = l_fd;
+    for (i = 0; i < 3; i++) {
+        // the handle may cross binder, which can't carry -1: stand in
+        // /dev/null, the reader knows it isn't an input device
+        if (fds[i] < 0)
+            fds[i] = open("/dev/null", O_RDONLY);
+        handle->data[i] = fds[i];
+    }
 
     return handle;
 }
 
-static int control__activate(struct sensors_control_context_t *dev,
-        int handle, int enabled)
+/*
+ * Duty cycling. While the screen is off, or while the proximity sensor is
+ * enabled and reports something near (the phone against the ear), sensors
+ * whose consumers can't benefit are slowed down or turned off, and put
+ * back as they were afterwards. The action per sensor and condition can be
+ * overridden with ro.sensors.policy.<name> = "<screen off>/<near>", each
+ * one of run, slow or off. A hardware sensor runs at the least restrictive
+ * action of everything that needs it, virtual sensors included.
+ */
+
+#define POLICY_SLOW_MS      200
+
+#define WAIT_FOR_FB_SLEEP   "/sys/power/wait_for_fb_sleep"
+#define WAIT_FOR_FB_WAKE    "/sys/power/wait_for_fb_wake"
+
+enum {
+    POLICY_RUN = 0,
+    POLICY_SLOW,
+    POLICY_OFF,
+};
+
+struct sensor_policy {
+    const char *name;
+    uint8_t screen_off;
+    uint8_t near;
+};
+
+static struct sensor_policy sPolicy[MAX_NUM_SENSORS] = {
+    [ID_A]  = { "accel",        POLICY_SLOW,    POLICY_SLOW },
+    [ID_M]  = { "mag",          POLICY_OFF,     POLICY_OFF },
+    [ID_O]  = { "orientation",  POLICY_OFF,     POLICY_OFF },
+    [ID_T]  = { "temperature",  POLICY_SLOW,    POLICY_SLOW },
+    [ID_P]  = { "proximity",    POLICY_RUN,     POLICY_RUN },
+    [ID_L]  = { "light",        POLICY_RUN,     POLICY_RUN },
+    [ID_R]  = { "rotation",     POLICY_OFF,     POLICY_OFF },
+    [ID_SK] = { "shake",        POLICY_RUN,     POLICY_OFF },
+    [ID_DT] = { "double_tap",   POLICY_RUN,     POLICY_OFF },
+    [ID_FL] = { "flip",         POLICY_RUN,     POLICY_RUN },
+    [ID_PU] = { "pick_up",      POLICY_RUN,     POLICY_RUN },
+};
+
+// g_policy_lock protects the policy state and the control device it acts on
+static pthread_mutex_t g_policy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_policy_once = PTHREAD_ONCE_INIT;
+static struct sensors_control_context_t *g_policy_dev;
+static int g_screen_on = 1;
+static int g_prox_near;
+
+static void policy_apply(struct sensors_control_context_t *dev);
+static void reader_forget(uint32_t sensors);
+
+static int policy_parse(const char *s, int len)
 {
-    if ((handle < SENSORS_HANDLE_BASE) ||
-            (handle >= SENSORS_HANDLE_BASE+MAX_NUM_SENSORS))
+    if (len == 4 && !strncmp(s, "slow", 4))
+        return POLICY_SLOW;
+    if (len == 3 && !strncmp(s, "off", 3))
+        return POLICY_OFF;
+    if (len == 3 && !strncmp(s, "run", 3))
+        return POLICY_RUN;
+    return -1;
+}
+
+static void policy_load(void)
+{
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    int i;
+
+    for (i = 0; i < MAX_NUM_SENSORS; i++) {
+        const char *slash;
+        int off, near;
+        snprintf(key, sizeof(key), "ro.sensors.policy.%s", sPolicy[i].name);
+        if (property_get(key, value, NULL) <= 0)
+            continue;
+        slash = strchr(value, '/');
+        off = policy_parse(value, slash ? slash - value : (int)strlen(value));
+        near = slash ? policy_parse(slash + 1, strlen(slash + 1)) : off;
+        if (off < 0 || near < 0) {
+            LOGE("%s: bad policy \"%s\"", key, value);
+            continue;
+        }
+        sPolicy[i].screen_off = off;
+        sPolicy[i].near = near;
+    }
+}
+
+static void policy_update(int *state, int value)
+{
+    pthread_mutex_lock(&g_policy_lock);
+    if (*state != value) {
+        *state = value;
+        LOGV("policy: screen %s, proximity %s",
+             g_screen_on ? "on" : "off", g_prox_near ? "near" : "far");
+        if (g_policy_dev)
+            policy_apply(g_policy_dev);
+    }
+    pthread_mutex_unlock(&g_policy_lock);
+}
+
+static void policy_set_proximity(int near)
+{
+    policy_update(&g_prox_near, near);
+}
+
+static int wait_for_fb(const char *path)
+{
+    char buf;
+    int fd, err;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
         return -1;
+    do {
+        err = read(fd, &buf, 1);
+    } while (err < 0 && errno == EINTR);
+    close(fd);
+    return err < 0 ? -1 : 0;
+}
 
-    uint32_t mask = (1 << handle);
-    uint32_t sensors = enabled ? mask : 0;
+static void *screen_thread(void *arg)
+{
+    // these reads block until the framebuffer goes to sleep or wakes up
+    while (wait_for_fb(WAIT_FOR_FB_SLEEP) == 0) {
+        policy_update(&g_screen_on, 0);
+        if (wait_for_fb(WAIT_FOR_FB_WAKE) < 0)
+            break;
+        policy_update(&g_screen_on, 1);
+    }
+    LOGV("screen state not available (%s)", strerror(errno));
+    return NULL;
+}
+
+static void policy_init(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    policy_load();
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, screen_thread, NULL))
+        LOGE("Couldn't start the screen state thread");
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Hardware sensors to run for the requested ones under the current
+ * conditions; *slow is set if the AKM sensors may run at POLICY_SLOW_MS.
+ */
+static uint32_t policy_sensors(uint32_t requested, int *slow)
+{
+    int near = g_prox_near && (requested & SENSORS_CM_PROXIMITY);
+    int level[MAX_NUM_SENSORS];
+    uint32_t hardware = 0;
+    int i, j;
+
+    for (i = 0; i < MAX_NUM_SENSORS; i++)
+        level[i] = POLICY_OFF;
+
+    for (i = 0; i < MAX_NUM_SENSORS; i++) {
+        uint32_t needs;
+        int action = POLICY_RUN;
+        if (!(requested & (1<<i)))
+            continue;
+        if (!g_screen_on)
+            action = sPolicy[i].screen_off;
+        if (near && sPolicy[i].near > action)
+            action = sPolicy[i].near;
+        if (action == POLICY_OFF)
+            continue;
+
+        needs = ((1u<<i) & SENSORS_HARDWARE) ?
+                (1u<<i) : virtual_dependencies(1u<<i);
+        for (j = 0; j < MAX_NUM_SENSORS; j++) {
+            if ((needs & (1u<<j)) && action < level[j])
+                level[j] = action;
+        }
+        hardware |= needs;
+    }
+
+    *slow = 0;
+    for (i = 0; i < MAX_NUM_SENSORS; i++) {
+        if (!(hardware & SENSORS_AKM_GROUP & (1<<i)))
+            continue;
+        if (level[i] == POLICY_RUN) {
+            *slow = 0;
+            break;
+        }
+        *slow = 1;
+    }
+    return hardware;
+}
+
+static int akm_set_delay(struct sensors_control_context_t *dev, int32_t ms)
+{
+#ifdef ECS_IOCTL_APP_SET_DELAY
+    if (dev->akmd_fd < 0) {
+        return -1;
+    }
+    short delay = ms;
+    if (ioctl(dev->akmd_fd, ECS_IOCTL_APP_SET_DELAY, &delay) < 0) {
+        return -errno;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
 
+/* called with g_policy_lock held */
+static void policy_apply(struct sensors_control_context_t *dev)
+{
+    int slow;
     uint32_t active = dev->active_sensors;
-    uint32_t new_sensors = (active & ~mask) | (sensors & mask);
+    uint32_t new_sensors = policy_sensors(dev->requested_sensors, &slow);
     uint32_t changed = active ^ new_sensors;
 
     if (changed) {
@@ -563,393 +876,1547 @@ static int control__activate(struct sensors_control_context_t *dev,
                               changed & SENSORS_LIGHT_GROUP);
     }
 
-    return 0;
+    if (slow != dev->throttled && dev->akmd_fd >= 0) {
+        if (slow) {
+            if (dev->delay_ms < POLICY_SLOW_MS)
+                akm_set_delay(dev, POLICY_SLOW_MS);
+        } else if (dev->delay_ms) {
+            akm_set_delay(dev, dev->delay_ms);
+        }
+        dev->throttled = slow;
+    }
 }
 
-static int control__set_delay(struct sensors_control_context_t *dev, int32_t ms)
+static int control__activate(struct sensors_control_context_t *dev,
+        int handle, int enabled)
 {
-#ifdef ECS_IOCTL_APP_SET_DELAY
-    if (dev->akmd_fd <= 0) {
+    if ((handle < SENSORS_HANDLE_BASE) ||
+            (handle >= SENSORS_HANDLE_BASE+MAX_NUM_SENSORS))
         return -1;
-    }
-    short delay = ms;
-    if (!ioctl(dev->akmd_fd, ECS_IOCTL_APP_SET_DELAY, &delay)) {
-        return -errno;
-    }
+
+    uint32_t mask = (1 << handle);
+    uint32_t requested;
+
+    pthread_mutex_lock(&g_policy_lock);
+    requested = enabled ?
+            (dev->requested_sensors | mask) : (dev->requested_sensors & ~mask);
+    mask &= requested ^ dev->requested_sensors;
+    dev->requested_sensors = requested;
+    g_requested_sensors = dev->requested_sensors;
+    policy_apply(dev);
+    pthread_mutex_unlock(&g_policy_lock);
+
+    // the deadband holds back readings close to the last one, which is
+    // stale once the sensor was off: let the next reading through
+    if (mask & SENSORS_AKM_TEMPERATURE)
+        reader_forget(SENSORS_AKM_TEMPERATURE);
     return 0;
-#else
-    return -1;
-#endif
 }
 
-static int control__wake(struct sensors_control_context_t *dev)
+static int control__set_delay(struct sensors_control_context_t *dev, int32_t ms)
 {
     int err = 0;
-    int akm_fd, p_fd, l_fd;
-    if (open_inputs(O_RDWR, &akm_fd, &p_fd, &l_fd) < 0 ||
-            akm_fd < 0 || p_fd < 0 || l_fd < 0) {
-        return -1;
-    }
+
+    pthread_mutex_lock(&g_policy_lock);
+    dev->delay_ms = ms;
+    // while throttled only remember it, it applies again afterwards
+    if (!dev->throttled || ms >= POLICY_SLOW_MS)
+        err = akm_set_delay(dev, ms);
+    pthread_mutex_unlock(&g_policy_lock);
+    return err;
+}
+
+static int control__wake(struct sensors_control_context_t *dev)
+{
+    int err = -1;
+    int fds[3];
+    int i;
+
+    open_inputs(O_RDWR, &fds[0], &fds[1], &fds[2]);
 
     struct input_event event[1];
     event[0].type = EV_SYN;
     event[0].code = SYN_CONFIG;
     event[0].value = 0;
 
-    err = write(akm_fd, event, sizeof(event));
-    LOGV_IF(err<0, "control__wake(compass), fd=%d (%s)",
-            akm_fd, strerror(errno));
-    close(akm_fd);
-
-    err = write(p_fd, event, sizeof(event));
-    LOGV_IF(err<0, "control__wake(proximity), fd=%d (%s)",
-            p_fd, strerror(errno));
-    close(p_fd);
-
-    err = write(l_fd, event, sizeof(event));
-    LOGV_IF(err<0, "control__wake(light), fd=%d (%s)",
-            l_fd, strerror(errno));
-    close(l_fd);
+    // any one device will do, the reader wakes every data device up
+    for (i = 0; i < 3; i++) {
+        if (fds[i] < 0)
+            continue;
+        if (err < 0) {
+            err = write(fds[i], event, sizeof(event));
+            LOGV_IF(err<0, "control__wake(%s), fd=%d (%s)",
+                    sInputDevices[i], fds[i], strerror(errno));
+        }
+        close(fds[i]);
+    }
 
     return err;
 }
 
 /*****************************************************************************/
 
-static int data__data_open(struct sensors_data_context_t *dev, native_handle_t* handle)
-{
-    int i;
-    struct input_absinfo absinfo;
-    memset(&dev->sensors, 0, sizeof(dev->sensors));
+/*
+ * ABS event decoding is table driven: each input device has a table indexed
+ * by event code that says which sensor the value belongs to, which slot of
+ * sensors_vec_t it lands in and how to convert it. Remapping an axis or
+ * adding a chip is a table edit.
+ */
 
-    for (i = 0; i < MAX_NUM_SENSORS; i++) {
-        // by default all sensors have high accuracy
-        // (we do this because we don't get an update if the value doesn't
-        // change).
-        dev->sensors[i].vector.status = SENSOR_STATUS_ACCURACY_HIGH;
-    }
-
-    dev->sensors[ID_A].sensor = SENSOR_TYPE_ACCELEROMETER;
-    dev->sensors[ID_M].sensor = SENSOR_TYPE_MAGNETIC_FIELD;
-    dev->sensors[ID_O].sensor = SENSOR_TYPE_ORIENTATION;
-    dev->sensors[ID_T].sensor = SENSOR_TYPE_TEMPERATURE;
-    dev->sensors[ID_P].sensor = SENSOR_TYPE_PROXIMITY;
-    dev->sensors[ID_L].sensor = SENSOR_TYPE_LIGHT;
-
-    dev->events_fd[0] = dup(handle->data[0]);
-    dev->events_fd[1] = dup(handle->data[1]);
-    dev->events_fd[2] = dup(handle->data[2]);
-    LOGV("data__data_open: compass fd = %d", handle->data[0]);
-    LOGV("data__data_open: proximity fd = %d", handle->data[1]);
-    LOGV("data__data_open: light fd = %d", handle->data[2]);
-    // Framework will close the handle
-    native_handle_delete(handle);
+#define ABS_TABLE_SIZE  64      // ABS_MAX + 1
 
-    dev->pendingSensors = 0;
-    if (!ioctl(dev->events_fd[1], EVIOCGABS(ABS_DISTANCE), &absinfo)) {
-        LOGV("proximity sensor initial value %d\n", absinfo.value);
-        dev->pendingSensors |= SENSORS_CM_PROXIMITY;
-        // FIXME: we should save here absinfo.{minimum, maximum, etc}
-        //        and use them to scale the return value according to
-        //        the sensor description.
-        dev->sensors[ID_P].distance = (float)absinfo.value;
-    }
-    else LOGE("Cannot get proximity sensor initial value: %s\n",
-              strerror(errno));
+enum {
+    ABS_KIND_NONE = 0,          // ignored
+    ABS_KIND_LINEAR,            // v[axis] = value * scale
+    ABS_KIND_STATUS,            // calibration accuracy, no new sample
+    ABS_KIND_LUX,               // light level index into sLuxValues
+};
 
-    return 0;
-}
+struct abs_decoder {
+    uint8_t kind;
+    uint8_t id;
+    uint8_t axis;
+    float scale;
+};
 
-static int data__data_close(struct sensors_data_context_t *dev)
+static const struct abs_decoder sAkmAbs[ABS_TABLE_SIZE] = {
+    [EVENT_TYPE_ACCEL_X]        = { ABS_KIND_LINEAR, ID_A, 0, CONVERT_A_X },
+    [EVENT_TYPE_ACCEL_Y]        = { ABS_KIND_LINEAR, ID_A, 1, CONVERT_A_Y },
+    [EVENT_TYPE_ACCEL_Z]        = { ABS_KIND_LINEAR, ID_A, 2, CONVERT_A_Z },
+    [EVENT_TYPE_MAGV_X]         = { ABS_KIND_LINEAR, ID_M, 0, CONVERT_M_X },
+    [EVENT_TYPE_MAGV_Y]         = { ABS_KIND_LINEAR, ID_M, 1, CONVERT_M_Y },
+    [EVENT_TYPE_MAGV_Z]         = { ABS_KIND_LINEAR, ID_M, 2, CONVERT_M_Z },
+    [EVENT_TYPE_YAW]            = { ABS_KIND_LINEAR, ID_O, 0, 1.0f },
+    [EVENT_TYPE_PITCH]          = { ABS_KIND_LINEAR, ID_O, 1, 1.0f },
+    [EVENT_TYPE_ROLL]           = { ABS_KIND_LINEAR, ID_O, 2, -1.0f },
+    [EVENT_TYPE_TEMPERATURE]    = { ABS_KIND_LINEAR, ID_T, 0, 1.0f },
+    // step count (only reported in MODE_FFD) and the accelerometer
+    // calibration accuracy (never returned) are ignored.
+    [EVENT_TYPE_ORIENT_STATUS]  = { ABS_KIND_STATUS, ID_O, 0, 0.0f },
+};
+
+static const struct abs_decoder sCmAbs[ABS_TABLE_SIZE] = {
+    /* event->value seems to be 0 or 1, scale it to the threshold */
+    [EVENT_TYPE_PROXIMITY]      = { ABS_KIND_LINEAR, ID_P, 0, PROXIMITY_THRESHOLD_CM },
+};
+
+static const struct abs_decoder sLsAbs[ABS_TABLE_SIZE] = {
+    [EVENT_TYPE_LIGHT]          = { ABS_KIND_LUX, ID_L, 0, 0.0f },
+};
+
+static uint32_t data__poll_process_abs(sensors_data_t *sensors,
+                                       const struct abs_decoder *table,
+                                       struct input_event *event)
 {
-    if (dev->events_fd[0] >= 0) {
-        //LOGV("(data close) about to close compass fd=%d", dev->events_fd[0]);
-        close(dev->events_fd[0]);
-        dev->events_fd[0] = -1;
+    const struct abs_decoder *d;
+    sensors_vec_t *v;
+
+    if (event->type != EV_ABS || event->code >= ABS_TABLE_SIZE)
+        return 0;
+
+    LOGV("abs type: %d code: %d value: %-5d time: %ds",
+         event->type, event->code, event->value,
+         (int)event->time.tv_sec);
+
+    d = &table[event->code];
+    v = &sensors[d->id].vector;
+    switch (d->kind) {
+    case ABS_KIND_LINEAR:
+        v->v[d->axis] = event->value * d->scale;
+        return 1 << d->id;
+    case ABS_KIND_STATUS: {
+        // accuracy of the calibration
+        uint8_t status = (uint8_t)(event->value & SENSOR_STATE_MASK);
+        LOGV_IF(v->status != status, "M-Sensor status %d", status);
+        v->status = status;
+        return 0;
     }
-    if (dev->events_fd[1] >= 0) {
-        //LOGV("(data close) about to close proximity fd=%d", dev->events_fd[1]);
-        close(dev->events_fd[1]);
-        dev->events_fd[1] = -1;
+    case ABS_KIND_LUX: {
+        int index = event->value;
+        if (index < 0)
+            return 0;
+        if (index >= (int)ARRAY_SIZE(sLuxValues))
+            index = ARRAY_SIZE(sLuxValues) - 1;
+        v->v[d->axis] = sLuxValues[index];
+        return 1 << d->id;
     }
-    if (dev->events_fd[2] >= 0) {
-        //LOGV("(data close) about to close light fd=%d", dev->events_fd[1]);
-        close(dev->events_fd[2]);
-        dev->events_fd[2] = -1;
     }
     return 0;
 }
 
-static int pick_sensor(struct sensors_data_context_t *dev,
-        sensors_data_t* values)
-{
-    uint32_t mask = SUPPORTED_SENSORS;
-    while (mask) {
-        uint32_t i = 31 - __builtin_clz(mask);
-        mask &= ~(1<<i);
-        if (dev->pendingSensors & (1<<i)) {
-            dev->pendingSensors &= ~(1<<i);
-            *values = dev->sensors[i];
-            values->sensor = id_to_sensor[i];
-            LOGV_IF(0, "%d [%f, %f, %f]",
-                    values->sensor,
-                    values->vector.x,
-                    values->vector.y,
-                    values->vector.z);
-            return i;
-        }
-    }
+/*
+ * Direct channel (see sensors_direct.h). The ring is created with the first
+ * direct device or by the reader, and unmapped once neither is left. The
+ * reader holds its reference for as long as it runs and is the only
+ * writer, so it publishes every sample without taking g_direct_lock.
+ */
 
-    LOGE("no sensor to return: pendingSensors = %08x", dev->pendingSensors);
-    return -1;
-}
+#define DIRECT_NUM_SLOTS    256
+#define DIRECT_RING_SIZE    (sizeof(struct sensors_direct_ring) + \
+        DIRECT_NUM_SLOTS * sizeof(struct sensors_direct_slot))
 
-static uint32_t data__poll_process_akm_abs(struct sensors_data_context_t *dev,
-                                           int fd __attribute__((unused)),
-                                           struct input_event *event)
+static pthread_mutex_t g_direct_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_direct_refs;
+static int g_direct_fd = -1;
+static struct sensors_direct_ring *g_direct_ring;
+
+static int direct_ring_get(void)
 {
-    uint32_t new_sensors = 0;
-    if (event->type == EV_ABS) {
-        LOGV("compass type: %d code: %d value: %-5d time: %ds",
-             event->type, event->code, event->value,
-             (int)event->time.tv_sec);
-        switch (event->code) {
-        case EVENT_TYPE_ACCEL_X:
-            new_sensors |= SENSORS_AKM_ACCELERATION;
-            dev->sensors[ID_A].acceleration.x = event->value * CONVERT_A_X;
-            break;
-        case EVENT_TYPE_ACCEL_Y:
-            new_sensors |= SENSORS_AKM_ACCELERATION;
-            dev->sensors[ID_A].acceleration.y = event->value * CONVERT_A_Y;
-            break;
-        case EVENT_TYPE_ACCEL_Z:
-            new_sensors |= SENSORS_AKM_ACCELERATION;
-            dev->sensors[ID_A].acceleration.z = event->value * CONVERT_A_Z;
-            break;
-        case EVENT_TYPE_MAGV_X:
-            new_sensors |= SENSORS_AKM_MAGNETIC_FIELD;
-            dev->sensors[ID_M].magnetic.x = event->value * CONVERT_M_X;
-            break;
-        case EVENT_TYPE_MAGV_Y:
-            new_sensors |= SENSORS_AKM_MAGNETIC_FIELD;
-            dev->sensors[ID_M].magnetic.y = event->value * CONVERT_M_Y;
-            break;
-        case EVENT_TYPE_MAGV_Z:
-            new_sensors |= SENSORS_AKM_MAGNETIC_FIELD;
-            dev->sensors[ID_M].magnetic.z = event->value * CONVERT_M_Z;
-            break;
-        case EVENT_TYPE_YAW:
-            new_sensors |= SENSORS_AKM_ORIENTATION;
-            dev->sensors[ID_O].orientation.azimuth =  event->value;
-            break;
-        case EVENT_TYPE_PITCH:
-            new_sensors |= SENSORS_AKM_ORIENTATION;
-            dev->sensors[ID_O].orientation.pitch = event->value;
-            break;
-        case EVENT_TYPE_ROLL:
-            new_sensors |= SENSORS_AKM_ORIENTATION;
-            dev->sensors[ID_O].orientation.roll = -event->value;
-            break;
-        case EVENT_TYPE_TEMPERATURE:
-            new_sensors |= SENSORS_AKM_TEMPERATURE;
-            dev->sensors[ID_T].temperature = event->value;
-            break;
-        case EVENT_TYPE_STEP_COUNT:
-            // step count (only reported in MODE_FFD)
-            // we do nothing with it for now.
-            break;
-        case EVENT_TYPE_ACCEL_STATUS:
-            // accuracy of the calibration (never returned!)
-            //LOGV("G-Sensor status %d", event->value);
-            break;
-        case EVENT_TYPE_ORIENT_STATUS: {
-            // accuracy of the calibration
-            uint32_t v = (uint32_t)(event->value & SENSOR_STATE_MASK);
-            LOGV_IF(dev->sensors[ID_O].orientation.status != (uint8_t)v,
-                    "M-Sensor status %d", v);
-            dev->sensors[ID_O].orientation.status = (uint8_t)v;
+    int err = 0;
+
+    pthread_mutex_lock(&g_direct_lock);
+    if (!g_direct_refs) {
+        int fd = ashmem_create_region("sensors-direct", DIRECT_RING_SIZE);
+        void *base = MAP_FAILED;
+        if (fd >= 0) {
+            base = mmap(NULL, DIRECT_RING_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
         }
-            break;
+        // consumers may only map the ring read-only
+        if (base == MAP_FAILED || ashmem_set_prot_region(fd, PROT_READ) < 0) {
+            LOGE("Couldn't create the direct channel (%s)", strerror(errno));
+            if (base != MAP_FAILED)
+                munmap(base, DIRECT_RING_SIZE);
+            if (fd >= 0)
+                close(fd);
+            err = -errno;
+        } else {
+            struct sensors_direct_ring *ring = base;
+            ring->magic = SENSORS_DIRECT_MAGIC;
+            ring->version = SENSORS_DIRECT_VERSION;
+            ring->num_slots = DIRECT_NUM_SLOTS;
+            ring->slot_size = sizeof(struct sensors_direct_slot);
+            g_direct_fd = fd;
+            g_direct_ring = ring;
         }
     }
-
-    return new_sensors;
+    if (!err)
+        g_direct_refs++;
+    pthread_mutex_unlock(&g_direct_lock);
+    return err;
 }
 
-static uint32_t data__poll_process_cm_abs(struct sensors_data_context_t *dev,
-                                           int fd __attribute__((unused)),
-                                          struct input_event *event)
+static void direct_ring_put(void)
 {
-    uint32_t new_sensors = 0;
-    if (event->type == EV_ABS) {
-        LOGV("proximity type: %d code: %d value: %-5d time: %ds",
-             event->type, event->code, event->value,
-             (int)event->time.tv_sec);
-        if (event->code == EVENT_TYPE_PROXIMITY) {
-            new_sensors |= SENSORS_CM_PROXIMITY;
-            /* event->value seems to be 0 or 1, scale it to the threshold */
-            dev->sensors[ID_P].distance = event->value * PROXIMITY_THRESHOLD_CM;
-        }
+    pthread_mutex_lock(&g_direct_lock);
+    if (--g_direct_refs == 0) {
+        munmap(g_direct_ring, DIRECT_RING_SIZE);
+        close(g_direct_fd);
+        g_direct_ring = NULL;
+        g_direct_fd = -1;
     }
-    return new_sensors;
+    pthread_mutex_unlock(&g_direct_lock);
 }
 
-static uint32_t data__poll_process_ls_abs(struct sensors_data_context_t *dev,
-                                          int fd __attribute__((unused)),
-                                          struct input_event *event)
+/* called from the reader thread only, ring is the one it holds */
+static void direct_publish(struct sensors_direct_ring *ring,
+                           const sensors_data_t *data, int sensor)
 {
-    uint32_t new_sensors = 0;
-    if (event->type == EV_ABS) {
-        LOGV("light-level type: %d code: %d value: %-5d time: %ds",
-             event->type, event->code, event->value,
-             (int)event->time.tv_sec);
-        if (event->code == EVENT_TYPE_LIGHT) {
-            int index= event->value;
-            if (index >= 0) {
-                new_sensors |= SENSORS_LIGHT;
-                if (index >= ARRAY_SIZE(sLuxValues)) {
-                    index = ARRAY_SIZE(sLuxValues) - 1;
-                }
-                dev->sensors[ID_L].light = sLuxValues[index];
-            }
-        }
-    }
-    return new_sensors;
+    struct sensors_direct_slot *slot;
+    uint32_t n = ring->head;
+
+    slot = &ring->slots[n % DIRECT_NUM_SLOTS];
+    slot->seq = 2 * n + 1;
+    ANDROID_MEMBAR_FULL();
+    slot->data = *data;
+    slot->data.sensor = sensor;
+    android_atomic_release_store(2 * n + 2, &slot->seq);
+    android_atomic_release_store(n + 1, &ring->head);
 }
 
-static void data__poll_process_syn(struct sensors_data_context_t *dev,
-                                   struct input_event *event,
-                                   uint32_t new_sensors)
+static int direct__get_region(struct sensors_direct_device_t *dev,
+        int *fd, size_t *size)
 {
-    if (new_sensors) {
-        dev->pendingSensors |= new_sensors;
-        int64_t t = event->time.tv_sec*1000000000LL +
-            event->time.tv_usec*1000;
-        while (new_sensors) {
-            uint32_t i = 31 - __builtin_clz(new_sensors);
-            new_sensors &= ~(1<<i);
-            dev->sensors[i].time = t;
-        }
+    *fd = g_direct_fd;
+    *size = DIRECT_RING_SIZE;
+    return 0;
+}
+
+/*
+ * Magnetometer calibration. Hard iron (the bias) comes from a least
+ * squares sphere fit, |m - c|^2 = r^2, rewritten as the linear problem
+ * 2m.c + (r^2 - |c|^2) = |m|^2 whose 4x4 normal equations are accumulated
+ * with exponential forgetting, so memory is constant and old environments
+ * fade out. Soft iron is approximated by a per-axis scale from the extent
+ * of the corrected samples. Accuracy follows from how many octants around
+ * the bias have been seen.
+ *
+ * akmd already calibrates the AKM8973 on this board, so this is off
+ * unless the board sets ro.sensors.magcal=1.
+ *
+ * The state is mmapped from MAGCAL_FILE so it survives reboots. Only the
+ * process holding the file lock writes it back; others calibrate from a
+ * private copy.
+ */
+
+#ifndef MAGCAL_FILE
+#define MAGCAL_FILE         "/data/system/sensors_magcal.bin"
+#endif
+#define MAGCAL_MAGIC        0x4d43414c  // 'MCAL'
+#define MAGCAL_VERSION      1
+
+#define MAGCAL_FORGET       0.998       // weight kept per accepted sample
+#define MAGCAL_MIN_STEP     4.0f        // uT between accepted samples
+#define MAGCAL_SOLVE_EVERY  8           // accepted samples between fits
+#define MAGCAL_MIN_FIELD    15.0f       // plausible geomagnetic field, uT
+#define MAGCAL_MAX_FIELD    90.0f
+#define MAGCAL_MIN_SCALE    0.8f
+#define MAGCAL_MAX_SCALE    1.25f
+
+struct magcal_state {
+    uint32_t magic;
+    uint32_t version;
+    double ata[4][4];
+    double atb[4];
+    float last[3];          // last accepted sample
+    float bias[3];
+    float scale[3];
+    float min[3];           // extent of the samples around the bias
+    float max[3];
+    float radius;
+    uint32_t octants;       // octants around the bias seen so far
+    uint32_t samples;       // accepted since the last fit
+    uint32_t valid;
+};
+
+static struct magcal_state *g_magcal;
+static struct magcal_state g_magcal_mem;
+static int g_magcal_fd = -1;
+
+static void magcal_reset_extent(struct magcal_state *st)
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        st->min[i] = 1e9f;
+        st->max[i] = -1e9f;
+        st->scale[i] = 1.0f;
     }
+    st->octants = 0;
 }
 
-static int data__poll(struct sensors_data_context_t *dev, sensors_data_t* values)
+static void magcal_reset(struct magcal_state *st)
 {
-    int akm_fd = dev->events_fd[0];
-    int cm_fd = dev->events_fd[1];
-    int ls_fd = dev->events_fd[2];
+    memset(st, 0, sizeof(*st));
+    st->magic = MAGCAL_MAGIC;
+    st->version = MAGCAL_VERSION;
+    magcal_reset_extent(st);
+}
 
-    if (akm_fd < 0) {
-        LOGE("invalid compass file descriptor, fd=%d", akm_fd);
-        return -1;
+static void magcal_open(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+    struct stat sb;
+    void *base = MAP_FAILED;
+    int fd;
+
+    property_get("ro.sensors.magcal", value, "0");
+    if (strcmp(value, "1")) {
+        g_magcal = NULL;
+        return;
     }
 
-    if (cm_fd < 0) {
-        LOGE("invalid proximity-sensor file descriptor, fd=%d", cm_fd);
-        return -1;
+    fd = open(MAGCAL_FILE, O_RDWR | O_CREAT, 0600);
+    if (fd >= 0 && !flock(fd, LOCK_EX | LOCK_NB) &&
+            !ftruncate(fd, sizeof(struct magcal_state))) {
+        base = mmap(NULL, sizeof(struct magcal_state),
+                    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    } else {
+        // someone else owns the file (or we may not write it): start from
+        // what it holds but keep our updates private
+        if (fd >= 0)
+            close(fd);
+        fd = open(MAGCAL_FILE, O_RDONLY);
+        if (fd >= 0 && !fstat(fd, &sb) &&
+                sb.st_size >= (off_t)sizeof(struct magcal_state)) {
+            base = mmap(NULL, sizeof(struct magcal_state),
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        }
     }
 
-    if (ls_fd < 0) {
-        LOGE("invalid light-sensor file descriptor, fd=%d", ls_fd);
-        return -1;
+    if (base == MAP_FAILED) {
+        LOGV("magcal: no persistent state (%s)", strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        g_magcal_fd = -1;
+        g_magcal = &g_magcal_mem;
+    } else {
+        g_magcal_fd = fd;
+        g_magcal = base;
     }
+    if (g_magcal->magic != MAGCAL_MAGIC || g_magcal->version != MAGCAL_VERSION)
+        magcal_reset(g_magcal);
+}
 
-    // there are pending sensors, returns them now...
-    if (dev->pendingSensors) {
-        LOGV("pending sensors 0x%08x", dev->pendingSensors);
-        return pick_sensor(dev, values);
+static void magcal_close(void)
+{
+    if (g_magcal_fd >= 0) {
+        munmap(g_magcal, sizeof(struct magcal_state));
+        close(g_magcal_fd);
+        g_magcal_fd = -1;
     }
+    g_magcal = NULL;
+}
 
-    // wait until we get a complete event for an enabled sensor
-    uint32_t new_sensors = 0;
-    while (1) {
-        /* read the next event; first, read the compass event, then the
-           proximity event */
-        struct input_event event;
-        int got_syn = 0;
-        int exit = 0;
-        int nread;
-        fd_set rfds;
-        int n;
+/* Solve the normal equations by Gaussian elimination with pivoting. */
+static int magcal_solve(const struct magcal_state *st, double p[4])
+{
+    double m[4][5];
+    int i, j, k;
 
-        FD_ZERO(&rfds);
-        FD_SET(akm_fd, &rfds);
-        FD_SET(cm_fd, &rfds);
-        FD_SET(ls_fd, &rfds);
-        n = select(__MAX(akm_fd, __MAX(cm_fd, ls_fd)) + 1, &rfds,
-                   NULL, NULL, NULL);
-        LOGV("return from select: %d\n", n);
-        if (n < 0) {
-            LOGE("%s: error from select(%d, %d): %s",
-                 __FUNCTION__,
-                 akm_fd, cm_fd, strerror(errno));
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 4; j++)
+            m[i][j] = st->ata[i][j];
+        m[i][4] = st->atb[i];
+    }
+    for (i = 0; i < 4; i++) {
+        int pivot = i;
+        for (j = i + 1; j < 4; j++) {
+            if (fabs(m[j][i]) > fabs(m[pivot][i]))
+                pivot = j;
+        }
+        if (fabs(m[pivot][i]) < 1e-6)
             return -1;
+        if (pivot != i) {
+            for (k = 0; k < 5; k++) {
+                double t = m[i][k];
+                m[i][k] = m[pivot][k];
+                m[pivot][k] = t;
+            }
+        }
+        for (j = i + 1; j < 4; j++) {
+            double f = m[j][i] / m[i][i];
+            for (k = i; k < 5; k++)
+                m[j][k] -= f * m[i][k];
+        }
+    }
+    for (i = 3; i >= 0; i--) {
+        double v = m[i][4];
+        for (j = i + 1; j < 4; j++)
+            v -= m[i][j] * p[j];
+        p[i] = v / m[i][i];
+    }
+    return 0;
+}
+
+static void magcal_fit(struct magcal_state *st)
+{
+    double p[4], r2;
+    float moved = 0;
+    int i;
+
+    if (magcal_solve(st, p))
+        return;
+    r2 = p[3] + p[0]*p[0] + p[1]*p[1] + p[2]*p[2];
+    if (r2 < MAGCAL_MIN_FIELD*MAGCAL_MIN_FIELD ||
+            r2 > MAGCAL_MAX_FIELD*MAGCAL_MAX_FIELD)
+        return;
+
+    for (i = 0; i < 3; i++)
+        moved += fabsf((float)p[i] - st->bias[i]);
+    // a new magnetic environment, the extent seen so far no longer applies
+    if (!st->valid || moved > 0.1f * st->radius)
+        magcal_reset_extent(st);
+
+    for (i = 0; i < 3; i++)
+        st->bias[i] = p[i];
+    st->radius = sqrt(r2);
+    st->valid = 1;
+
+    if (__builtin_popcount(st->octants) >= 6) {
+        for (i = 0; i < 3; i++) {
+            float half = (st->max[i] - st->min[i]) * 0.5f;
+            float scale = half > 0 ? st->radius / half : 1.0f;
+            if (scale < MAGCAL_MIN_SCALE)
+                scale = MAGCAL_MIN_SCALE;
+            if (scale > MAGCAL_MAX_SCALE)
+                scale = MAGCAL_MAX_SCALE;
+            st->scale[i] = scale;
         }
+    }
+}
 
-        if (FD_ISSET(akm_fd, &rfds)) {
-            nread = read(akm_fd, &event, sizeof(event));
-            if (nread == sizeof(event)) {
-                new_sensors |= data__poll_process_akm_abs(dev, akm_fd, &event);
-                LOGV("akm abs %08x", new_sensors);
-                got_syn = event.type == EV_SYN;
-                exit = got_syn && event.code == SYN_CONFIG;
-                if (got_syn) {
-                    LOGV("akm syn %08x", new_sensors);
-                    data__poll_process_syn(dev, &event, new_sensors);
-                    new_sensors = 0;
-                }
+static void magcal_update(struct magcal_state *st, const float m[3])
+{
+    double row[4], b;
+    float d[3];
+    int i, j;
+
+    for (i = 0; i < 3; i++)
+        d[i] = m[i] - st->last[i];
+    if (d[0]*d[0] + d[1]*d[1] + d[2]*d[2] < MAGCAL_MIN_STEP*MAGCAL_MIN_STEP)
+        return;
+    memcpy(st->last, m, sizeof(st->last));
+
+    row[0] = 2*m[0];
+    row[1] = 2*m[1];
+    row[2] = 2*m[2];
+    row[3] = 1;
+    b = m[0]*m[0] + m[1]*m[1] + m[2]*m[2];
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 4; j++)
+            st->ata[i][j] = st->ata[i][j] * MAGCAL_FORGET + row[i] * row[j];
+        st->atb[i] = st->atb[i] * MAGCAL_FORGET + row[i] * b;
+    }
+
+    if (st->valid) {
+        uint32_t octant = 0;
+        for (i = 0; i < 3; i++) {
+            float c = m[i] - st->bias[i];
+            if (c < st->min[i])
+                st->min[i] = c;
+            if (c > st->max[i])
+                st->max[i] = c;
+            octant |= (c < 0) << i;
+        }
+        st->octants |= 1 << octant;
+    }
+
+    if (++st->samples >= MAGCAL_SOLVE_EVERY) {
+        st->samples = 0;
+        magcal_fit(st);
+    }
+}
+
+/* Calibrate a magnetic field sample in place and set its accuracy. */
+static void magcal_apply(sensors_vec_t *v)
+{
+    struct magcal_state *st = g_magcal;
+    int octants, status, i;
+    float len2, r2;
+
+    if (!st)
+        return;
+
+    magcal_update(st, v->v);
+    if (!st->valid) {
+        v->status = SENSOR_STATUS_UNRELIABLE;
+        return;
+    }
+
+    for (i = 0; i < 3; i++)
+        v->v[i] = (v->v[i] - st->bias[i]) * st->scale[i];
+
+    octants = __builtin_popcount(st->octants);
+    if (octants >= 7)
+        status = SENSOR_STATUS_ACCURACY_HIGH;
+    else if (octants >= 4)
+        status = SENSOR_STATUS_ACCURACY_MEDIUM;
+    else
+        status = SENSOR_STATUS_ACCURACY_LOW;
+
+    // far off the fitted sphere: a local disturbance, trust it less
+    len2 = v->x*v->x + v->y*v->y + v->z*v->z;
+    r2 = st->radius * st->radius;
+    if ((len2 < 0.5625f * r2 || len2 > 1.5625f * r2) &&
+            status > SENSOR_STATUS_UNRELIABLE)
+        status--;
+    v->status = status;
+}
+
+/*
+ * Screen rotation detector, fed with the accelerometer samples. Gravity is
+ * low-pass filtered. A new rotation is only proposed while the device is
+ * held still (|a| close to 1g), not too flat, and well inside the new
+ * quadrant, and is reported once it has been held for ROT_SETTLE_NS.
+ */
+
+#define ROT_FILTER_TC       0.2f                // s, gravity low-pass
+#define ROT_MAX_TILT        70.0f               // degrees from vertical
+#define ROT_HYSTERESIS      15.0f               // degrees into the quadrant
+#define ROT_MAX_ACCEL_DEV   (0.3f*GRAVITY_EARTH)
+#define ROT_SETTLE_NS       300000000LL
+
+struct rotation_detector {
+    float g[3];
+    int64_t last_time;
+    int current;            // last reported rotation, -1 until the first
+    int proposed;           // candidate waiting to settle, or -1
+    int64_t proposed_time;
+};
+
+static struct rotation_detector g_rotation = { .current = -1, .proposed = -1 };
+
+/* Returns the new rotation when it changes, -1 otherwise. */
+static int rotation_update(struct rotation_detector *rd, const sensors_data_t *a)
+{
+    const float *v = a->acceleration.v;
+    float dt = (a->time - rd->last_time) * 1e-9f;
+    float mag, tilt, angle, off;
+    int quadrant, candidate, i;
+
+    if (!rd->last_time || dt <= 0 || dt > 1.0f) {
+        memcpy(rd->g, v, sizeof(rd->g));
+    } else {
+        float alpha = dt / (ROT_FILTER_TC + dt);
+        for (i = 0; i < 3; i++)
+            rd->g[i] += alpha * (v[i] - rd->g[i]);
+    }
+    rd->last_time = a->time;
+
+    // moving around, wait until things settle
+    mag = sqrtf(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+    if (fabsf(mag - GRAVITY_EARTH) > ROT_MAX_ACCEL_DEV) {
+        rd->proposed = -1;
+        return -1;
+    }
+
+    mag = sqrtf(rd->g[0]*rd->g[0] + rd->g[1]*rd->g[1] + rd->g[2]*rd->g[2]);
+    if (mag < 0.5f * GRAVITY_EARTH)
+        return -1;
+    tilt = asinf(rd->g[2] / mag) * (180.0f / M_PI);
+    if (fabsf(tilt) > ROT_MAX_TILT) {
+        rd->proposed = -1;
+        return -1;
+    }
+
+    // angle of the top of the device from up, clockwise
+    angle = atan2f(-rd->g[0], rd->g[1]) * (180.0f / M_PI);
+    if (angle < 0)
+        angle += 360.0f;
+    quadrant = ((int)((angle + 45.0f) / 90.0f)) & 3;
+    candidate = (4 - quadrant) & 3;
+    if (candidate == 2 || candidate == rd->current) {
+        rd->proposed = -1;
+        return -1;
+    }
+
+    off = fabsf(angle - quadrant * 90.0f);
+    if (off > 180.0f)
+        off = 360.0f - off;
+    if (rd->current >= 0 && off > 45.0f - ROT_HYSTERESIS)
+        return -1;
+
+    if (candidate != rd->proposed) {
+        rd->proposed = candidate;
+        rd->proposed_time = a->time;
+        return -1;
+    }
+    if (a->time - rd->proposed_time < ROT_SETTLE_NS)
+        return -1;
+
+    rd->current = candidate;
+    rd->proposed = -1;
+    return candidate;
+}
+
+/*
+ * Gesture engine, also fed with the accelerometer samples. Each gesture is
+ * a small state machine on the gravity estimate and the linear
+ * acceleration around it; there is no allocation and no sample history.
+ *
+ *  shake:      GESTURE_SHAKE_COUNT alternating peaks of linear
+ *              acceleration above the threshold within one second
+ *  double tap: two spikes of the z axis, 100-500 ms apart, with little
+ *              x/y motion and not during a shake
+ *  flip:       face up to face down within two seconds, then held still
+ *  pick up:    lying still for two seconds, then tilted by the threshold
+ */
+
+#define GESTURE_GRAVITY_TC      0.5f            // s, gravity low-pass
+#define GESTURE_SHAKE_WINDOW_NS 1000000000LL
+#define GESTURE_REFRACTORY_NS   1000000000LL    // quiet time after a shake
+#define GESTURE_TAP_DEBOUNCE_NS 80000000LL
+#define GESTURE_TAP_MIN_NS      100000000LL
+#define GESTURE_TAP_MAX_NS      500000000LL
+#define GESTURE_TAP_XY          0.5f            // of the tap threshold
+#define GESTURE_FLIP_WINDOW_NS  2000000000LL
+#define GESTURE_FLIP_FACE       (0.7f*GRAVITY_EARTH)
+#define GESTURE_STILL           0.5f            // m/s^2 of linear accel
+#define GESTURE_REST_NS         2000000000LL
+
+struct gesture_config {
+    float shake_threshold;      // m/s^2
+    int shake_count;
+    float tap_threshold;        // m/s^2 jump on z between samples
+    int64_t flip_settle_ns;
+    float pick_up_angle;        // degrees
+};
+
+struct gesture_engine {
+    struct gesture_config cfg;
+    float g[3];
+    float last_z;
+    int64_t last_time;
+
+    int shake_peaks;
+    int shake_sign;
+    int shake_axis;
+    int64_t shake_first;
+    int64_t shake_quiet_until;
+
+    int64_t tap_spike;
+    int64_t tap_first;
+
+    int64_t face_up;            // last time seen face up
+    int64_t face_down;          // face down since, 0 if not
+    int flip_armed;
+
+    int64_t still_since;
+    int resting;
+    float rest_g[3];
+};
+
+static struct gesture_engine g_gestures;
+
+static float property_get_float(const char *key, float def)
+{
+    char value[PROPERTY_VALUE_MAX];
+    char *end;
+    float f;
+
+    if (property_get(key, value, NULL) <= 0)
+        return def;
+    f = strtod(value, &end);
+    return end != value ? f : def;
+}
+
+static void gesture_init(struct gesture_engine *ge)
+{
+    memset(ge, 0, sizeof(*ge));
+    ge->cfg.shake_threshold =
+            property_get_float("ro.sensors.gesture.shake", 12.0f);
+    ge->cfg.shake_count =
+            property_get_float("ro.sensors.gesture.shake_count", 4);
+    ge->cfg.tap_threshold =
+            property_get_float("ro.sensors.gesture.tap", 6.0f);
+    ge->cfg.flip_settle_ns =
+            property_get_float("ro.sensors.gesture.flip_ms", 500) * 1000000LL;
+    ge->cfg.pick_up_angle =
+            property_get_float("ro.sensors.gesture.pick_up_angle", 30.0f);
+    ge->flip_armed = 1;
+}
+
+static int gesture_shake(struct gesture_engine *ge, const float lin[3], int64_t t)
+{
+    int axis = 0, sign, i;
+
+    if (t < ge->shake_quiet_until)
+        return 0;
+    if (ge->shake_peaks && t - ge->shake_first > GESTURE_SHAKE_WINDOW_NS)
+        ge->shake_peaks = 0;
+
+    for (i = 1; i < 3; i++) {
+        if (fabsf(lin[i]) > fabsf(lin[axis]))
+            axis = i;
+    }
+    if (fabsf(lin[axis]) < ge->cfg.shake_threshold)
+        return 0;
+    sign = lin[axis] > 0 ? 1 : -1;
+
+    if (!ge->shake_peaks || axis != ge->shake_axis) {
+        ge->shake_peaks = 1;
+        ge->shake_axis = axis;
+        ge->shake_sign = sign;
+        ge->shake_first = t;
+    } else if (sign != ge->shake_sign) {
+        ge->shake_sign = sign;
+        if (++ge->shake_peaks >= ge->cfg.shake_count) {
+            ge->shake_peaks = 0;
+            ge->shake_quiet_until = t + GESTURE_REFRACTORY_NS;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int gesture_double_tap(struct gesture_engine *ge, const float lin[3],
+                              float z, int64_t t)
+{
+    float xy = ge->cfg.tap_threshold * GESTURE_TAP_XY;
+    int fired = 0;
+
+    // a shake swings z as hard as a tap: nothing from one in progress (a
+    // single peak may be the tap itself) or from its quiet time, and a
+    // tap before it doesn't pair with a spike after
+    if (ge->shake_peaks >= 2 || t < ge->shake_quiet_until) {
+        ge->tap_first = 0;
+        return 0;
+    }
+    // a tap on the screen or the back hardly moves the phone sideways
+    if (lin[0]*lin[0] + lin[1]*lin[1] >= xy * xy)
+        return 0;
+    if (fabsf(z - ge->last_z) < ge->cfg.tap_threshold ||
+            t - ge->tap_spike < GESTURE_TAP_DEBOUNCE_NS)
+        return 0;
+    ge->tap_spike = t;
+
+    if (ge->tap_first && t - ge->tap_first >= GESTURE_TAP_MIN_NS &&
+            t - ge->tap_first <= GESTURE_TAP_MAX_NS) {
+        ge->tap_first = 0;
+        fired = 1;
+    } else {
+        ge->tap_first = t;
+    }
+    return fired;
+}
+
+static int gesture_flip(struct gesture_engine *ge, const float v[3], int64_t t)
+{
+    // the raw sample rather than the gravity estimate, which lags
+    float mag = sqrtf(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+    int still = fabsf(mag - GRAVITY_EARTH) < 2 * GESTURE_STILL;
+
+    if (v[2] > GESTURE_FLIP_FACE) {
+        ge->face_up = t;
+        ge->face_down = 0;
+        ge->flip_armed = 1;
+        return 0;
+    }
+    if (v[2] > -GESTURE_FLIP_FACE) {
+        ge->face_down = 0;
+        return 0;
+    }
+    if (!ge->face_down) {
+        // only a quick turn over counts
+        if (!ge->face_up || t - ge->face_up > GESTURE_FLIP_WINDOW_NS)
+            ge->flip_armed = 0;
+        ge->face_down = t;
+    }
+    if (ge->flip_armed && still && t - ge->face_down >= ge->cfg.flip_settle_ns) {
+        ge->flip_armed = 0;
+        return 1;
+    }
+    return 0;
+}
+
+static int gesture_pick_up(struct gesture_engine *ge, int still, int64_t t)
+{
+    float dot, n1, n2;
+
+    if (!ge->resting) {
+        if (!still) {
+            ge->still_since = 0;
+        } else if (!ge->still_since) {
+            ge->still_since = t;
+        } else if (t - ge->still_since >= GESTURE_REST_NS) {
+            ge->resting = 1;
+            memcpy(ge->rest_g, ge->g, sizeof(ge->rest_g));
+        }
+        return 0;
+    }
+
+    dot = ge->g[0]*ge->rest_g[0] + ge->g[1]*ge->rest_g[1] + ge->g[2]*ge->rest_g[2];
+    n1 = sqrtf(ge->g[0]*ge->g[0] + ge->g[1]*ge->g[1] + ge->g[2]*ge->g[2]);
+    n2 = sqrtf(ge->rest_g[0]*ge->rest_g[0] + ge->rest_g[1]*ge->rest_g[1] +
+               ge->rest_g[2]*ge->rest_g[2]);
+    if (n1 * n2 <= 0)
+        return 0;
+    if (acosf(fminf(1.0f, dot / (n1 * n2))) * (180.0f / M_PI) <
+            ge->cfg.pick_up_angle)
+        return 0;
+    ge->resting = 0;
+    ge->still_since = 0;
+    return 1;
+}
+
+/* Returns the gestures (as sensor bits) completed by this sample. */
+static uint32_t gesture_update(struct gesture_engine *ge, const sensors_data_t *a)
+{
+    const float *v = a->acceleration.v;
+    float dt = (a->time - ge->last_time) * 1e-9f;
+    float lin[3];
+    uint32_t fired = 0;
+    int still, i;
+
+    if (!ge->last_time || dt <= 0 || dt > 1.0f) {
+        memcpy(ge->g, v, sizeof(ge->g));
+        ge->last_z = v[2];
+    } else {
+        float alpha = dt / (GESTURE_GRAVITY_TC + dt);
+        for (i = 0; i < 3; i++)
+            ge->g[i] += alpha * (v[i] - ge->g[i]);
+    }
+    ge->last_time = a->time;
+
+    for (i = 0; i < 3; i++)
+        lin[i] = v[i] - ge->g[i];
+    still = lin[0]*lin[0] + lin[1]*lin[1] + lin[2]*lin[2] <
+            GESTURE_STILL * GESTURE_STILL;
+
+    if (gesture_shake(ge, lin, a->time))
+        fired |= SENSORS_SHAKE;
+    if (gesture_double_tap(ge, lin, v[2], a->time))
+        fired |= SENSORS_DOUBLE_TAP;
+    if (gesture_flip(ge, v, a->time))
+        fired |= SENSORS_FLIP;
+    if (gesture_pick_up(ge, still, a->time))
+        fired |= SENSORS_PICK_UP;
+
+    ge->last_z = v[2];
+    return fired;
+}
+
+/*
+ * Timestamps. The input devices are switched to CLOCK_MONOTONIC when the
+ * kernel supports it, otherwise event times are moved from the wall clock
+ * to the monotonic clock as they are read, so NTP or NITZ updates don't
+ * make them jump. The streaming AKM sensors then go through a filter that
+ * tracks their sample period and smooths out the scheduling jitter of
+ * akmd: each output is the previous one plus the period, pulled a little
+ * towards the measured time and never later than it.
+ */
+
+#ifndef EVIOCSCLOCKID
+#define EVIOCSCLOCKID       _IOW('E', 0xa0, int)
+#endif
+
+#define SENSORS_DEJITTER    (SENSORS_AKM_ACCELERATION | \
+                             SENSORS_AKM_MAGNETIC_FIELD | \
+                             SENSORS_AKM_ORIENTATION)
+
+#define TS_PERIOD_GAIN      0.05f   // period estimate update
+#define TS_PHASE_GAIN       0.1f    // pull towards the measured time
+
+struct ts_filter {
+    int64_t last_in;
+    int64_t last_out;
+    float period;           // ns, 0 until two samples were seen
+};
+
+static int64_t realtime_offset(void)
+{
+    struct timespec rt, mono;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    return (rt.tv_sec - mono.tv_sec) * 1000000000LL +
+           (rt.tv_nsec - mono.tv_nsec);
+}
+
+static int64_t ts_filter(struct ts_filter *f, int64_t t)
+{
+    float dt = t - f->last_in;
+    int64_t out;
+
+    if (!f->last_in || dt <= 0) {
+        f->period = 0;
+        out = t;
+    } else if (!f->period || dt < 0.5f * f->period || dt > 2.0f * f->period) {
+        // first period, a gap or a new rate: start over from here
+        f->period = dt;
+        out = t;
+    } else {
+        int64_t predicted = f->last_out + (int64_t)f->period;
+        f->period += TS_PERIOD_GAIN * (dt - f->period);
+        out = predicted + (int64_t)(TS_PHASE_GAIN * (t - predicted));
+        if (out > t)
+            out = t;
+        if (out <= f->last_out)
+            out = f->last_out + 1;
+    }
+    f->last_in = t;
+    f->last_out = out;
+    return out;
+}
+
+/*
+ * All opened data devices share one reader: a thread that owns the input
+ * fds, decodes every event once and fans the samples out to the devices,
+ * each of which sees only the sensors in its mask, no faster than its
+ * rate. SYN_CONFIG (see control__wake) wakes every device up.
+ */
+
+struct sensors_reader_t {
+    int refs;
+    int running;
+    pthread_t thread;
+    int events_fd[3];
+    int stop_fds[2];
+    sensors_data_t raw[MAX_NUM_SENSORS];    // as decoded
+    sensors_data_t sensors[MAX_NUM_SENSORS];    // as reported
+    uint32_t known;     // sensors that have a value in sensors[]
+    int monotonic[3];   // events_fd[] stamps events with CLOCK_MONOTONIC
+    int backoff_ms[3];  // reopen interval of a missing device
+    int64_t retry_ms[3];    // next reopen attempt, CLOCK_MONOTONIC
+    struct ts_filter ts[MAX_NUM_SENSORS];
+    float temperature_deadband;  // ro.sensors.temperature.deadband, in C
+    struct sensors_data_context_t *clients;
+    struct sensors_direct_ring *direct;     // held while running, or NULL
+};
+
+// g_reader_open_lock serializes starting and stopping the reader thread,
+// g_reader_lock protects the sample state and the client list.
+static pthread_mutex_t g_reader_open_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_reader_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sensors_reader_t g_reader = {
+    .events_fd = { -1, -1, -1 },
+    .stop_fds = { -1, -1 },
+};
+
+/* drops the last values of sensors, so their next samples count as new */
+static void reader_forget(uint32_t sensors)
+{
+    pthread_mutex_lock(&g_reader_lock);
+    g_reader.known &= ~sensors;
+    pthread_mutex_unlock(&g_reader_lock);
+}
+
+static const struct abs_decoder *const sAbsTables[3] = {
+    sAkmAbs, sCmAbs, sLsAbs,
+};
+
+static const char *const sInputNames[3] = {
+    "compass", "proximity", "light",
+};
+
+static const uint32_t sInputSensors[3] = {
+    SENSORS_AKM_GROUP, SENSORS_CM_GROUP, SENSORS_LIGHT_GROUP,
+};
+
+// a device that went away is looked for again after REOPEN_MIN_MS, then
+// twice as long every time it isn't there, up to REOPEN_MAX_MS
+#define REOPEN_MIN_MS   250
+#define REOPEN_MAX_MS   30000
+
+static int64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000LL + ts.tv_nsec/1000000;
+}
+
+/* called with g_reader_lock held, returns the virtual sensors updated */
+static uint32_t virtual_process(uint32_t new_sensors, int64_t t)
+{
+    uint32_t updated = 0;
+    uint32_t gestures, mask;
+
+    if (new_sensors & SENSORS_AKM_ACCELERATION) {
+        int rotation = rotation_update(&g_rotation, &g_reader.sensors[ID_A]);
+        if (rotation >= 0) {
+            g_reader.sensors[ID_R].vector.v[0] = rotation;
+            g_reader.sensors[ID_R].vector.status = SENSOR_STATUS_ACCURACY_HIGH;
+            g_reader.sensors[ID_R].time = t;
+            updated |= SENSORS_ROTATION;
+        }
+
+        gestures = gesture_update(&g_gestures, &g_reader.sensors[ID_A]);
+        mask = gestures;
+        while (mask) {
+            uint32_t i = 31 - __builtin_clz(mask);
+            mask &= ~(1<<i);
+            g_reader.sensors[i].vector.v[0] = 1.0f;
+            g_reader.sensors[i].vector.status = SENSOR_STATUS_ACCURACY_HIGH;
+            g_reader.sensors[i].time = t;
+        }
+        updated |= gestures;
+    }
+    return updated;
+}
+
+/* called with g_reader_lock held */
+static void reader_dispatch(uint32_t new_sensors, int wake)
+{
+    struct sensors_data_context_t *client;
+
+    g_reader.known |= new_sensors;
+    if (!new_sensors && !wake)
+        return;
+    for (client = g_reader.clients; client; client = client->next) {
+        uint32_t mask = new_sensors & client->mask;
+        uint32_t pending = client->pendingSensors;
+        while (mask) {
+            uint32_t i = 31 - __builtin_clz(mask);
+            int64_t t = g_reader.sensors[i].time;
+            mask &= ~(1<<i);
+            if (client->delay_ns && !(SENSORS_ON_CHANGE & (1<<i)) &&
+                    t - client->last_time[i] < client->delay_ns)
+                continue;
+            client->sensors[i] = g_reader.sensors[i];
+            client->last_time[i] = t;
+            client->pendingSensors |= 1<<i;
+        }
+        if (wake)
+            client->wake = 1;
+        if (wake || client->pendingSensors != pending)
+            pthread_cond_signal(&client->cond);
+    }
+}
+
+/*
+ * Called with g_reader_lock held. A new proximity state is returned in
+ * *near (left alone otherwise) for the caller to hand to the duty cycling
+ * policy once it has dropped the lock.
+ */
+static void data__poll_process_syn(struct input_event *event, int64_t t,
+                                   uint32_t new_sensors, int *near)
+{
+    if (new_sensors) {
+        uint32_t mask = new_sensors;
+        while (mask) {
+            uint32_t i = 31 - __builtin_clz(mask);
+            mask &= ~(1<<i);
+            if (i == ID_T && (g_reader.known & SENSORS_AKM_TEMPERATURE) &&
+                    fabsf(g_reader.raw[i].temperature -
+                          g_reader.sensors[i].temperature) <
+                    g_reader.temperature_deadband) {
+                // akmd reports it with every sample, only pass on changes
+                new_sensors &= ~(1<<i);
+                continue;
             }
-            else LOGE("akm read too small %d", nread);
-        }
-        else LOGV("akm fd is not set");
-
-        if (FD_ISSET(cm_fd, &rfds)) {
-            nread = read(cm_fd, &event, sizeof(event));
-            if (nread == sizeof(event)) {
-                new_sensors |= data__poll_process_cm_abs(dev, cm_fd, &event);
-                LOGV("cm abs %08x", new_sensors);
-                got_syn |= event.type == EV_SYN;
-                exit |= got_syn && event.code == SYN_CONFIG;
-                if (got_syn) {
-                    LOGV("cm syn %08x", new_sensors);
-                    data__poll_process_syn(dev, &event, new_sensors);
-                    new_sensors = 0;
-                }
+            g_reader.sensors[i] = g_reader.raw[i];
+            g_reader.sensors[i].time = (SENSORS_DEJITTER & (1<<i)) ?
+                    ts_filter(&g_reader.ts[i], t) : t;
+            if (i == ID_M)
+                magcal_apply(&g_reader.sensors[i].magnetic);
+            if (i == ID_P)
+                *near = g_reader.sensors[i].distance < 0.5f;
+        }
+        new_sensors |= virtual_process(new_sensors, t);
+        new_sensors &= reported_sensors();
+
+        mask = g_reader.direct ? new_sensors : 0;
+        while (mask) {
+            uint32_t i = 31 - __builtin_clz(mask);
+            mask &= ~(1<<i);
+            direct_publish(g_reader.direct, &g_reader.sensors[i],
+                           id_to_sensor[i]);
+        }
+    }
+    reader_dispatch(new_sensors, event->code == SYN_CONFIG);
+}
+
+/*
+ * Drains one input fd, returns -1 if it failed. new_sensors accumulates
+ * the sensors updated since that device's last EV_SYN.
+ */
+static int reader_read(int index, uint32_t *new_sensors)
+{
+    struct input_event events[16];
+    int64_t offset;
+    int nread, n, i, near = -1;
+
+    nread = read(g_reader.events_fd[index], events, sizeof(events));
+    if (nread < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return 0;
+        LOGE("%s read error (%s)", sInputNames[index], strerror(errno));
+        return -1;
+    }
+    n = nread / sizeof(events[0]);
+    if (n == 0) {
+        LOGE("%s read too small %d", sInputNames[index], nread);
+        return -1;
+    }
+
+    // without EVIOCSCLOCKID the events carry wall clock time
+    offset = g_reader.monotonic[index] ? 0 : realtime_offset();
+
+    pthread_mutex_lock(&g_reader_lock);
+    for (i = 0; i < n; i++) {
+        struct input_event *event = &events[i];
+        if (event->type == EV_SYN) {
+            int64_t t = event->time.tv_sec*1000000000LL +
+                event->time.tv_usec*1000 - offset;
+            LOGV("%s syn %08x", sInputNames[index], *new_sensors);
+            data__poll_process_syn(event, t, *new_sensors, &near);
+            *new_sensors = 0;
+        } else {
+            *new_sensors |= data__poll_process_abs(g_reader.raw,
+                    sAbsTables[index], event);
+        }
+    }
+    pthread_mutex_unlock(&g_reader_lock);
+    // the policy takes its own lock and talks to the drivers
+    if (near >= 0)
+        policy_set_proximity(near);
+    return 0;
+}
+
+/*
+ * Makes fd the input of device index if it is that device (the data source
+ * stands /dev/null in for the ones it couldn't open), closes it otherwise.
+ * Returns -1 if the device is missing.
+ */
+static int reader_attach(int index, int fd)
+{
+    struct input_absinfo absinfo;
+    char name[80];
+    int clk = CLOCK_MONOTONIC;
+    int i;
+
+    g_reader.events_fd[index] = -1;
+    if (fd < 0)
+        return -1;
+    if (ioctl(fd, EVIOCGNAME(sizeof(name) - 1), &name) < 1 ||
+            strcmp(name, sInputDevices[index])) {
+        close(fd);
+        return -1;
+    }
+    g_reader.events_fd[index] = fd;
+    g_reader.monotonic[index] = !ioctl(fd, EVIOCSCLOCKID, &clk);
+    g_reader.backoff_ms[index] = REOPEN_MIN_MS;
+
+    pthread_mutex_lock(&g_reader_lock);
+    // a new node restarts its timestamps
+    for (i = 0; i < MAX_NUM_SENSORS; i++) {
+        if (sInputSensors[index] & (1<<i))
+            memset(&g_reader.ts[i], 0, sizeof(g_reader.ts[i]));
+    }
+    if (index == 1) {
+        if (!ioctl(fd, EVIOCGABS(ABS_DISTANCE), &absinfo)) {
+            LOGV("proximity sensor initial value %d\n", absinfo.value);
+            // FIXME: we should save here absinfo.{minimum, maximum, etc}
+            //        and use them to scale the return value according to
+            //        the sensor description.
+            g_reader.raw[ID_P].distance = (float)absinfo.value;
+            g_reader.known |= SENSORS_CM_PROXIMITY;
+        }
+        else LOGE("Cannot get proximity sensor initial value: %s\n",
+                  strerror(errno));
+    }
+    pthread_mutex_unlock(&g_reader_lock);
+    return 0;
+}
+
+/* the reader thread gives up on a device, until reader_reopen finds it */
+static void reader_detach(int index, int64_t now)
+{
+    LOGW("%s went away, looking for it again", sInputNames[index]);
+    close(g_reader.events_fd[index]);
+    g_reader.events_fd[index] = -1;
+    g_reader.backoff_ms[index] = REOPEN_MIN_MS;
+    g_reader.retry_ms[index] = now + REOPEN_MIN_MS;
+}
+
+/* tries to reopen the missing devices that are due, returns those found */
+static uint32_t reader_reopen(int64_t now)
+{
+    uint32_t found = 0;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        int fds[3] = { -1, -1, -1 };
+        if (g_reader.events_fd[i] >= 0 || now < g_reader.retry_ms[i])
+            continue;
+        find_inputs(O_RDONLY, fds, 1<<i);
+        if (reader_attach(i, fds[i]) < 0) {
+            g_reader.backoff_ms[i] *= 2;
+            if (g_reader.backoff_ms[i] > REOPEN_MAX_MS)
+                g_reader.backoff_ms[i] = REOPEN_MAX_MS;
+            g_reader.retry_ms[i] = now + g_reader.backoff_ms[i];
+            continue;
+        }
+        LOGI("%s is back", sInputNames[i]);
+        found |= 1<<i;
+    }
+    return found;
+}
+
+/* poll() timeout until the next reopen attempt, -1 if there is none */
+static int reader_timeout(int64_t now)
+{
+    int timeout = -1;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        int64_t wait;
+        if (g_reader.events_fd[i] >= 0)
+            continue;
+        wait = g_reader.retry_ms[i] - now;
+        if (wait < 0)
+            wait = 0;
+        if (timeout < 0 || wait < timeout)
+            timeout = (int)wait;
+    }
+    return timeout;
+}
+
+/*
+ * The reader keeps serving the devices it has when one goes away (driver
+ * reset, akmd restart) and reopens the missing ones in the background,
+ * even when none is left. It only stops when asked to through stop_fds,
+ * or if poll() fails.
+ */
+static void *reader_thread(void *arg)
+{
+    struct sensors_data_context_t *client;
+    uint32_t new_sensors[3] = { 0, 0, 0 };
+    struct pollfd fds[4];
+    int gone = 0;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        fds[i].fd = g_reader.events_fd[i];
+        fds[i].events = POLLIN;
+    }
+    fds[3].fd = g_reader.stop_fds[0];
+    fds[3].events = POLLIN;
+
+    while (1) {
+        int64_t now = monotonic_ms();
+        uint32_t found;
+        int n;
+
+        found = reader_reopen(now);
+        for (i = 0; i < 3; i++) {
+            if (!(found & (1<<i)))
+                continue;
+            fds[i].fd = g_reader.events_fd[i];
+            new_sensors[i] = 0;
+            if (i == 1) {
+                // hand out the proximity state the driver came back with
+                struct input_event syn;
+                int near = -1;
+                memset(&syn, 0, sizeof(syn));
+                syn.type = EV_SYN;
+                syn.code = SYN_REPORT;
+                pthread_mutex_lock(&g_reader_lock);
+                data__poll_process_syn(&syn, now*1000000LL,
+                        g_reader.known & SENSORS_CM_PROXIMITY, &near);
+                pthread_mutex_unlock(&g_reader_lock);
+                if (near >= 0)
+                    policy_set_proximity(near);
             }
-            else LOGE("cm read too small %d", nread);
-        }
-        else LOGV("cm fd is not set");
-
-        if (FD_ISSET(ls_fd, &rfds)) {
-            nread = read(ls_fd, &event, sizeof(event));
-            if (nread == sizeof(event)) {
-                new_sensors |= data__poll_process_ls_abs(dev, ls_fd, &event);
-                LOGV("ls abs %08x", new_sensors);
-                got_syn |= event.type == EV_SYN;
-                exit |= got_syn && event.code == SYN_CONFIG;
-                if (got_syn) {
-                    LOGV("ls syn %08x", new_sensors);
-                    data__poll_process_syn(dev, &event, new_sensors);
-                    new_sensors = 0;
-                }
+        }
+        // with every input gone only stop_fds is polled, until the next
+        // reopen attempt
+        if (fds[0].fd < 0 && fds[1].fd < 0 && fds[2].fd < 0) {
+            if (!gone)
+                LOGE("%s: all sensor inputs are gone, waiting for them",
+                     __FUNCTION__);
+            gone = 1;
+        } else {
+            gone = 0;
+        }
+
+        n = poll(fds, 4, reader_timeout(now));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGE("%s: error from poll: %s", __FUNCTION__, strerror(errno));
+            break;
+        }
+        if (fds[3].revents)
+            break;
+        for (i = 0; i < 3; i++) {
+            if (fds[i].fd < 0 || !fds[i].revents)
+                continue;
+            if ((fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) ||
+                    reader_read(i, &new_sensors[i]) < 0) {
+                reader_detach(i, monotonic_ms());
+                fds[i].fd = -1;
+                new_sensors[i] = 0;
             }
-            else LOGE("ls read too small %d", nread);
         }
-        else LOGV("ls fd is not set");
+    }
+
+    pthread_mutex_lock(&g_reader_lock);
+    g_reader.running = 0;
+    for (client = g_reader.clients; client; client = client->next)
+        pthread_cond_signal(&client->cond);
+    pthread_mutex_unlock(&g_reader_lock);
+    return NULL;
+}
+
+/* called with g_reader_open_lock held */
+static int reader_start(native_handle_t *handle)
+{
+    int64_t now = monotonic_ms();
+    int present = 0;
+    int i;
+
+    memset(g_reader.raw, 0, sizeof(g_reader.raw));
+    g_reader.known = 0;
+    for (i = 0; i < MAX_NUM_SENSORS; i++) {
+        // by default all sensors have high accuracy
+        // (we do this because we don't get an update if the value doesn't
+        // change).
+        g_reader.raw[i].vector.status = SENSOR_STATUS_ACCURACY_HIGH;
+        g_reader.raw[i].sensor = id_to_sensor[i];
+    }
+
+    memset(g_reader.ts, 0, sizeof(g_reader.ts));
+    for (i = 0; i < 3; i++) {
+        LOGV("reader_start: %s fd = %d", sInputNames[i], handle->data[i]);
+        if (reader_attach(i, dup(handle->data[i])) == 0) {
+            present++;
+            continue;
+        }
+        LOGW("%s is missing, looking for it in the background",
+             sInputNames[i]);
+        g_reader.backoff_ms[i] = REOPEN_MIN_MS;
+        g_reader.retry_ms[i] = now + REOPEN_MIN_MS;
+    }
+    if (!present) {
+        LOGE("No sensor input available");
+        return -1;
+    }
+
+    memcpy(g_reader.sensors, g_reader.raw, sizeof(g_reader.sensors));
+    magcal_open();
+    gesture_init(&g_gestures);
+    g_reader.temperature_deadband =
+            property_get_float("ro.sensors.temperature.deadband", 1.0f);
+    g_rotation.current = g_rotation.proposed = -1;
+    g_rotation.last_time = 0;
+
+    if (pipe(g_reader.stop_fds) < 0) {
+        LOGE("Couldn't create the reader pipe (%s)", strerror(errno));
+        goto fail;
+    }
+    // without the direct channel the data devices still work
+    g_reader.direct = direct_ring_get() == 0 ? g_direct_ring : NULL;
+    g_reader.running = 1;
+    if (pthread_create(&g_reader.thread, NULL, reader_thread, NULL)) {
+        LOGE("Couldn't start the reader thread");
+        g_reader.running = 0;
+        if (g_reader.direct)
+            direct_ring_put();
+        g_reader.direct = NULL;
+        goto fail;
+    }
+    return 0;
 
-        if (exit) {
-            // we use SYN_CONFIG to signal that we need to exit the
-            // main loop.
-            //LOGV("got empty message: value=%d", event->value);
-            LOGV("exit");
-            return 0x7FFFFFFF;
+fail:
+    magcal_close();
+    for (i = 0; i < 3; i++) {
+        if (g_reader.events_fd[i] >= 0)
+            close(g_reader.events_fd[i]);
+        g_reader.events_fd[i] = -1;
+    }
+    for (i = 0; i < 2; i++) {
+        if (g_reader.stop_fds[i] >= 0)
+            close(g_reader.stop_fds[i]);
+        g_reader.stop_fds[i] = -1;
+    }
+    return -1;
+}
+
+/* called with g_reader_open_lock held */
+static void reader_stop(void)
+{
+    int i;
+
+    write(g_reader.stop_fds[1], "", 1);
+    pthread_join(g_reader.thread, NULL);
+    if (g_reader.direct)
+        direct_ring_put();
+    g_reader.direct = NULL;
+    magcal_close();
+    for (i = 0; i < 3; i++) {
+        if (g_reader.events_fd[i] >= 0)
+            close(g_reader.events_fd[i]);
+        g_reader.events_fd[i] = -1;
+    }
+    for (i = 0; i < 2; i++) {
+        close(g_reader.stop_fds[i]);
+        g_reader.stop_fds[i] = -1;
+    }
+}
+
+static int data__data_open(struct sensors_data_context_t *dev, native_handle_t* handle)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&g_reader_open_lock);
+    if (dev->opened) {
+        // Framework will close the handle
+        native_handle_delete(handle);
+        pthread_mutex_unlock(&g_reader_open_lock);
+        return 0;
+    }
+    // the first device starts the reader with its fds, the others only
+    // register with it
+    if (!g_reader.refs)
+        err = reader_start(handle);
+    // Framework will close the handle
+    native_handle_delete(handle);
+    if (err) {
+        pthread_mutex_unlock(&g_reader_open_lock);
+        return err;
+    }
+    g_reader.refs++;
+
+    pthread_mutex_lock(&g_reader_lock);
+    memcpy(dev->sensors, g_reader.sensors, sizeof(dev->sensors));
+    memset(dev->last_time, 0, sizeof(dev->last_time));
+    // report the current proximity state and temperature straight away,
+    // they only come again when they change
+    dev->pendingSensors = dev->mask & g_reader.known &
+            (SENSORS_CM_PROXIMITY | SENSORS_AKM_TEMPERATURE);
+    dev->wake = 0;
+    dev->next = g_reader.clients;
+    g_reader.clients = dev;
+    dev->opened = 1;
+    pthread_mutex_unlock(&g_reader_lock);
+
+    pthread_mutex_unlock(&g_reader_open_lock);
+    return 0;
+}
+
+static int data__data_close(struct sensors_data_context_t *dev)
+{
+    struct sensors_data_context_t **p;
+
+    pthread_mutex_lock(&g_reader_open_lock);
+    if (dev->opened) {
+        pthread_mutex_lock(&g_reader_lock);
+        for (p = &g_reader.clients; *p; p = &(*p)->next) {
+            if (*p == dev) {
+                *p = dev->next;
+                break;
+            }
         }
+        dev->opened = 0;
+        pthread_cond_signal(&dev->cond);
+        pthread_mutex_unlock(&g_reader_lock);
+
+        if (--g_reader.refs == 0)
+            reader_stop();
+    }
+    pthread_mutex_unlock(&g_reader_open_lock);
+    return 0;
+}
 
-        if (got_syn && dev->pendingSensors) {
-            LOGV("got syn, picking sensor");
-            return pick_sensor(dev, values);
+static int pick_sensor(struct sensors_data_context_t *dev,
+        sensors_data_t* values)
+{
+    uint32_t mask = SUPPORTED_SENSORS;
+    while (mask) {
+        uint32_t i = 31 - __builtin_clz(mask);
+        mask &= ~(1<<i);
+        if (dev->pendingSensors & (1<<i)) {
+            dev->pendingSensors &= ~(1<<i);
+            *values = dev->sensors[i];
+            values->sensor = id_to_sensor[i];
+            LOGV_IF(0, "%d [%f, %f, %f]",
+                    values->sensor,
+                    values->vector.x,
+                    values->vector.y,
+                    values->vector.z);
+            return i;
         }
     }
+
+    LOGE("no sensor to return: pendingSensors = %08x", dev->pendingSensors);
+    return -1;
+}
+
+static int data__poll(struct sensors_data_context_t *dev, sensors_data_t* values)
+{
+    int ret;
+
+    pthread_mutex_lock(&g_reader_lock);
+    while (dev->opened && g_reader.running &&
+            !dev->wake && !dev->pendingSensors) {
+        pthread_cond_wait(&dev->cond, &g_reader_lock);
+    }
+
+    if (dev->wake) {
+        // we use SYN_CONFIG to signal that we need to exit the
+        // main loop.
+        LOGV("exit");
+        dev->wake = 0;
+        ret = 0x7FFFFFFF;
+    } else if (dev->pendingSensors) {
+        LOGV("pending sensors 0x%08x", dev->pendingSensors);
+        ret = pick_sensor(dev, values);
+    } else {
+        LOGE("%s: no input left to read", __FUNCTION__);
+        ret = -1;
+    }
+    pthread_mutex_unlock(&g_reader_lock);
+    return ret;
 }
 
 /*****************************************************************************/
@@ -959,6 +2426,11 @@ static int control__close(struct hw_device_t *dev)
     struct sensors_control_context_t* ctx =
         (struct sensors_control_context_t*)dev;
     if (ctx) {
+        pthread_mutex_lock(&g_policy_lock);
+        if (g_policy_dev == ctx)
+            g_policy_dev = NULL;
+        g_requested_sensors = -1;
+        pthread_mutex_unlock(&g_policy_lock);
         close_akm(ctx);
         close_cm(ctx);
         close_ls(ctx);
@@ -967,11 +2439,21 @@ static int control__close(struct hw_device_t *dev)
     return 0;
 }
 
+static int direct__close(struct hw_device_t *dev)
+{
+    if (dev) {
+        direct_ring_put();
+        free(dev);
+    }
+    return 0;
+}
+
 static int data__close(struct hw_device_t *dev)
 {
     struct sensors_data_context_t* ctx = (struct sensors_data_context_t*)dev;
     if (ctx) {
         data__data_close(ctx);
+        pthread_cond_destroy(&ctx->cond);
         free(ctx);
     }
     return 0;
@@ -983,6 +2465,7 @@ static int open_sensors(const struct hw_module_t* module, const char* name,
         struct hw_device_t** device)
 {
     int status = -EINVAL;
+    size_t data_len = strlen(SENSORS_HARDWARE_DATA);
     if (!strcmp(name, SENSORS_HARDWARE_CONTROL)) {
         struct sensors_control_context_t *dev;
         dev = malloc(sizeof(*dev));
@@ -999,13 +2482,26 @@ static int open_sensors(const struct hw_module_t* module, const char* name,
         dev->device.set_delay= control__set_delay;
         dev->device.wake = control__wake;
         *device = &dev->device.common;
-    } else if (!strcmp(name, SENSORS_HARDWARE_DATA)) {
+
+        pthread_once(&g_policy_once, policy_init);
+        pthread_mutex_lock(&g_policy_lock);
+        g_policy_dev = dev;
+        pthread_mutex_unlock(&g_policy_lock);
+    } else if (!strncmp(name, SENSORS_HARDWARE_DATA, data_len) &&
+            (name[data_len] == '\0' || name[data_len] == ':')) {
+        /* "data[:<hex sensor mask>[:<min interval in ms>]]" */
         struct sensors_data_context_t *dev;
+        const char *p = name + data_len;
         dev = malloc(sizeof(*dev));
         memset(dev, 0, sizeof(*dev));
-        dev->events_fd[0] = -1;
-        dev->events_fd[1] = -1;
-        dev->events_fd[2] = -1;
+        dev->mask = SUPPORTED_SENSORS;
+        if (*p == ':') {
+            char *end;
+            dev->mask = strtoul(p + 1, &end, 16) & SUPPORTED_SENSORS;
+            if (*end == ':')
+                dev->delay_ns = strtol(end + 1, NULL, 10) * 1000000LL;
+        }
+        pthread_cond_init(&dev->cond, NULL);
         dev->device.common.tag = HARDWARE_DEVICE_TAG;
         dev->device.common.version = 0;
         dev->device.common.module = module;
@@ -1014,6 +2510,20 @@ static int open_sensors(const struct hw_module_t* module, const char* name,
         dev->device.data_close = data__data_close;
         dev->device.poll = data__poll;
         *device = &dev->device.common;
+    } else if (!strcmp(name, SENSORS_HARDWARE_DIRECT)) {
+        struct sensors_direct_context_t *dev;
+        status = direct_ring_get();
+        if (status < 0)
+            return status;
+        dev = malloc(sizeof(*dev));
+        memset(dev, 0, sizeof(*dev));
+        dev->device.common.tag = HARDWARE_DEVICE_TAG;
+        dev->device.common.version = 0;
+        dev->device.common.module = module;
+        dev->device.common.close = direct__close;
+        dev->device.get_region = direct__get_region;
+        *device = &dev->device.common;
+        status = 0;
     }
     return status;
 }
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SENSORS_DIRECT_H
+#define ANDROID_SENSORS_DIRECT_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#include <hardware/sensors.h>
+#include <cutils/atomic.h>
+#include <cutils/atomic-inline.h>
+
+__BEGIN_DECLS
+
+/*
+ * Direct sample channel of the mahimahi sensors module.
+ *
+ * Opening SENSORS_HARDWARE_DIRECT on the module returns a
+ * sensors_direct_device_t whose get_region() hands out an ashmem fd. The
+ * region holds a sensors_direct_ring that the module fills with every
+ * sample it decodes, whichever data device is polling. Consumers mmap it
+ * PROT_READ (the region refuses anything else), possibly in another
+ * process after the fd has been passed over binder, and read it without
+ * locks or system calls.
+ *
+ * The ring carries the sensors the control device has activated, the same
+ * ones the data devices see; the direct device doesn't enable anything by
+ * itself, so a consumer has to activate what it reads through the control
+ * device like any poll client.
+ *
+ * The writer publishes sample n into slots[n % num_slots] and then bumps
+ * head to n + 1. While a slot is written its seq is odd (2n + 1); when the
+ * write is complete it is 2n + 2, so a reader can tell a finished sample
+ * from one that is being overwritten by a later lap.
+ */
+
+#define SENSORS_HARDWARE_DIRECT     "direct"
+
+#define SENSORS_DIRECT_MAGIC        0x53445231  // 'SDR1'
+#define SENSORS_DIRECT_VERSION      1
+
+struct sensors_direct_slot {
+    volatile int32_t seq;
+    uint32_t reserved;
+    sensors_data_t data;
+};
+
+struct sensors_direct_ring {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    volatile int32_t head;
+    uint32_t reserved[3];
+    struct sensors_direct_slot slots[0];
+};
+
+struct sensors_direct_device_t {
+    struct hw_device_t common;
+
+    /**
+     * Returns the ashmem fd of the ring and its size in bytes. The fd
+     * stays owned by the device; dup() it to keep or send it.
+     */
+    int (*get_region)(struct sensors_direct_device_t *dev,
+            int *fd, size_t *size);
+};
+
+/**
+ * Reads the next sample after *cursor. Start with *cursor = ring->head to
+ * only see new samples.
+ *
+ * Returns 1 and advances *cursor if a sample was copied to *out, 0 if
+ * there is nothing new, or -1 if the writer lapped the reader; *cursor has
+ * then been moved to the oldest sample still in the ring and the call can
+ * simply be repeated.
+ */
+static inline int sensors_direct_read(const struct sensors_direct_ring *ring,
+        uint32_t *cursor, sensors_data_t *out)
+{
+    const struct sensors_direct_slot *slot;
+    uint32_t head = (uint32_t)android_atomic_acquire_load(&ring->head);
+    uint32_t n = *cursor;
+    int32_t done = (int32_t)(2 * n + 2);
+
+    if (n == head)
+        return 0;
+    if (head - n > ring->num_slots)
+        goto lapped;
+
+    slot = &ring->slots[n % ring->num_slots];
+    if (android_atomic_acquire_load(&slot->seq) != done)
+        goto lapped;
+    *out = slot->data;
+    ANDROID_MEMBAR_FULL();
+    if (slot->seq != done)
+        goto lapped;
+
+    *cursor = n + 1;
+    return 1;
+
+lapped:
+    head = (uint32_t)android_atomic_acquire_load(&ring->head);
+    // until the first lap only slots 0 .. head - 1 have been written
+    *cursor = head > ring->num_slots ? head - ring->num_slots + 1 : 0;
+    return -1;
+}
+
+__END_DECLS
+
+#endif  // ANDROID_SENSORS_DIRECT_H
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SENSORS_VIRTUAL_H
+#define ANDROID_SENSORS_VIRTUAL_H
+
+/*
+ * Sensors the mahimahi module computes itself from the hardware ones. They
+ * are listed by get_sensors_list() with these private types and only
+ * report changes.
+ */
+
+#define SENSOR_TYPE_MAHIMAHI_BASE           0x10000
+
+/*
+ * Display rotation the device is being held in, in v[0], as the
+ * Surface.ROTATION_* value (0: natural, 1: 90 degrees counter-clockwise,
+ * 3: 90 degrees clockwise). Upside down (2) is not reported.
+ */
+#define SENSOR_TYPE_SCREEN_ORIENTATION      (SENSOR_TYPE_MAHIMAHI_BASE + 1)
+
+/*
+ * Gesture triggers. Each event is one gesture, v[0] is 1. Thresholds can be
+ * tuned with the ro.sensors.gesture.* properties.
+ */
+#define SENSOR_TYPE_SHAKE                   (SENSOR_TYPE_MAHIMAHI_BASE + 2)
+#define SENSOR_TYPE_DOUBLE_TAP              (SENSOR_TYPE_MAHIMAHI_BASE + 3)
+#define SENSOR_TYPE_FLIP                    (SENSOR_TYPE_MAHIMAHI_BASE + 4)
+#define SENSOR_TYPE_PICK_UP                 (SENSOR_TYPE_MAHIMAHI_BASE + 5)
+
+#endif  // ANDROID_SENSORS_VIRTUAL_H
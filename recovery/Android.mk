@@ -0,0 +1,62 @@
+# Copyright (C) 2010 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+LOCAL_PATH := $(call my-dir)
+
+#
+# librle565: run-length encoded 565 bitmaps, for the recovery UI and tools
+#
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := rle565.c
+LOCAL_MODULE := librle565
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := rle565.c
+LOCAL_MODULE := librle565
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+#
+# png2565: host converter for the firmware_*.565 bitmaps
+#
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := png2565.c
+LOCAL_C_INCLUDES := external/libpng external/zlib
+LOCAL_STATIC_LIBRARIES := librle565 libpng libz
+LOCAL_MODULE := png2565
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
+
+# "make firmware-images" regenerates the bitmaps from the icons, checked
+# against bitmap_size.txt, for copying back into recovery/images.
+PNG2565 := $(HOST_OUT_EXECUTABLES)/png2565$(HOST_EXECUTABLE_SUFFIX)
+firmware_images_dir := $(call intermediates-dir-for,PACKAGING,firmware_images)
+firmware_images := $(addprefix $(firmware_images_dir)/, \
+	firmware_install.565 firmware_error.565)
+
+$(firmware_images): PRIVATE_SIZE := $(LOCAL_PATH)/images/bitmap_size.txt
+$(firmware_images): $(firmware_images_dir)/%.565: \
+		$(LOCAL_PATH)/images/icon_%.png \
+		$(LOCAL_PATH)/images/bitmap_size.txt \
+		$(PNG2565)
+	@echo "png2565: $@"
+	$(hide) mkdir -p $(dir $@)
+	$(hide) $(PNG2565) -s $(PRIVATE_SIZE) $< $@
+
+.PHONY: firmware-images
+firmware-images: $(firmware_images)
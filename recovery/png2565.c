@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * png2565: convert a PNG to the raw (or run-length encoded) RGB 565 bitmaps
+ * shown by hboot/recovery, centered on a black canvas of the given size and
+ * ordered-dithered down to 5/6/5 bits.
+ *
+ *   png2565 [-rle] [-s bitmap_size.txt | -w width -h height] in.png out.565
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <png.h>
+
+#include "rle565.h"
+
+/* 4x4 Bayer matrix, thresholds 0..15 */
+static const unsigned char bayer[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: png2565 [-rle] [-s bitmap_size.txt | -w width -h height] "
+            "in.png out.565\n");
+    exit(1);
+}
+
+static int read_bitmap_size(const char *path, int *width, int *height)
+{
+    FILE *f = fopen(path, "r");
+    int depth = 0;
+
+    if (!f) {
+        fprintf(stderr, "png2565: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fscanf(f, "%d %d %d", width, height, &depth) != 3 ||
+            *width <= 0 || *height <= 0) {
+        fprintf(stderr, "png2565: %s: expected \"width height depth\"\n", path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    if (depth != 16) {
+        fprintf(stderr, "png2565: %s: depth %d, only 16bpp is supported\n",
+                path, depth);
+        return -1;
+    }
+    return 0;
+}
+
+/* Load a PNG as 8-bit RGBA rows. */
+static png_bytep *load_png(const char *path, png_uint_32 *width,
+                           png_uint_32 *height)
+{
+    FILE *f;
+    png_structp png;
+    png_infop info;
+    png_bytep *rows = NULL;
+    png_uint_32 y;
+    int depth, type;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "png2565: %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info = png ? png_create_info_struct(png) : NULL;
+    if (!info) {
+        fprintf(stderr, "png2565: out of memory\n");
+        goto fail;
+    }
+    if (setjmp(png_jmpbuf(png))) {
+        fprintf(stderr, "png2565: %s: not a valid PNG\n", path);
+        goto fail;
+    }
+
+    png_init_io(png, f);
+    png_read_info(png, info);
+    png_get_IHDR(png, info, width, height, &depth, &type, NULL, NULL, NULL);
+
+    if (type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(png);
+    if (type == PNG_COLOR_TYPE_GRAY || type == PNG_COLOR_TYPE_GRAY_ALPHA)
+        png_set_gray_to_rgb(png);
+    if (png_get_valid(png, info, PNG_INFO_tRNS))
+        png_set_tRNS_to_alpha(png);
+    if (depth == 16)
+        png_set_strip_16(png);
+    if (depth < 8)
+        png_set_packing(png);
+    png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+    png_read_update_info(png, info);
+
+    rows = calloc(*height, sizeof(*rows));
+    if (!rows)
+        goto fail;
+    for (y = 0; y < *height; y++) {
+        rows[y] = malloc(*width * 4);
+        if (!rows[y])
+            goto fail;
+    }
+    png_read_image(png, rows);
+    png_read_end(png, NULL);
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(f);
+    return rows;
+
+fail:
+    if (rows) {
+        for (y = 0; y < *height; y++)
+            free(rows[y]);
+        free(rows);
+    }
+    png_destroy_read_struct(&png, info ? &info : NULL, NULL);
+    fclose(f);
+    return NULL;
+}
+
+/* Quantize one 8-bit channel to bits, adding the dither threshold. */
+static inline unsigned dither(unsigned v, unsigned bits, unsigned t)
+{
+    unsigned shift = 8 - bits;
+
+    /* scale the threshold to the quantization step and round */
+    v += (t << shift) >> 4;
+    if (v > 255)
+        v = 255;
+    return v >> shift;
+}
+
+int main(int argc, char **argv)
+{
+    const char *size_file = NULL;
+    int width = 0, height = 0;
+    int rle = 0;
+    png_bytep *rows;
+    png_uint_32 pw, ph, y;
+    uint16_t *pixels, *out;
+    size_t count, words;
+    int x, ox, oy;
+    FILE *f;
+    int i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-rle")) {
+            rle = 1;
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            size_file = argv[++i];
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            width = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-h") && i + 1 < argc) {
+            height = atoi(argv[++i]);
+        } else {
+            usage();
+        }
+    }
+    if (argc - i != 2)
+        usage();
+
+    if (size_file) {
+        int sw, sh;
+        if (read_bitmap_size(size_file, &sw, &sh))
+            return 1;
+        if ((width && width != sw) || (height && height != sh)) {
+            fprintf(stderr, "png2565: %dx%d does not match %s (%dx%d)\n",
+                    width, height, size_file, sw, sh);
+            return 1;
+        }
+        width = sw;
+        height = sh;
+    }
+    if (width <= 0 || height <= 0)
+        usage();
+
+    rows = load_png(argv[i], &pw, &ph);
+    if (!rows)
+        return 1;
+    if (pw > (png_uint_32)width || ph > (png_uint_32)height) {
+        fprintf(stderr, "png2565: %s is %ux%u, larger than %dx%d\n",
+                argv[i], (unsigned)pw, (unsigned)ph, width, height);
+        return 1;
+    }
+
+    count = (size_t)width * height;
+    pixels = calloc(count, sizeof(*pixels));
+    if (!pixels) {
+        fprintf(stderr, "png2565: out of memory\n");
+        return 1;
+    }
+
+    /* center on black, alpha is composited against the background */
+    ox = (width - pw) / 2;
+    oy = (height - ph) / 2;
+    for (y = 0; y < ph; y++) {
+        png_bytep p = rows[y];
+        uint16_t *dst = pixels + (size_t)(oy + y) * width + ox;
+        for (x = 0; x < (int)pw; x++, p += 4) {
+            unsigned a = p[3];
+            unsigned r = (p[0] * a + 127) / 255;
+            unsigned g = (p[1] * a + 127) / 255;
+            unsigned b = (p[2] * a + 127) / 255;
+            unsigned t = bayer[(oy + y) & 3][(ox + x) & 3];
+            dst[x] = (dither(r, 5, t) << 11) | (dither(g, 6, t) << 5) |
+                     dither(b, 5, t);
+        }
+        free(rows[y]);
+    }
+    free(rows);
+
+    if (rle) {
+        /* worst case is one run per pixel */
+        out = malloc(count * 2 * sizeof(*out));
+        if (!out) {
+            fprintf(stderr, "png2565: out of memory\n");
+            return 1;
+        }
+        words = rle565_encode(pixels, count, out, count * 2);
+    } else {
+        out = pixels;
+        words = count;
+    }
+
+    f = fopen(argv[i + 1], "wb");
+    if (!f) {
+        fprintf(stderr, "png2565: %s: %s\n", argv[i + 1], strerror(errno));
+        return 1;
+    }
+    if (fwrite(out, sizeof(*out), words, f) != words || fclose(f)) {
+        fprintf(stderr, "png2565: %s: write failed\n", argv[i + 1]);
+        unlink(argv[i + 1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "rle565.h"
+
+size_t rle565_encode(const uint16_t *pixels, size_t count,
+                     uint16_t *out, size_t out_words)
+{
+    size_t i = 0, n = 0;
+
+    while (i < count) {
+        uint16_t color = pixels[i];
+        size_t run = 1;
+
+        while (i + run < count && run < 0xffff && pixels[i + run] == color)
+            run++;
+        if (n + 2 > out_words)
+            return 0;
+        out[n++] = run;
+        out[n++] = color;
+        i += run;
+    }
+    return n;
+}
+
+int rle565_decode(const uint16_t *rle, size_t words,
+                  uint16_t *dst, int width, int height, int stride)
+{
+    uint16_t *row = dst;
+    int x = 0, y = 0;
+
+    for (; words >= 2; rle += 2, words -= 2) {
+        unsigned run = rle[0];
+        uint16_t color = rle[1];
+        unsigned i;
+
+        /* fill whole rows at once, long black runs are the common case */
+        while (run) {
+            unsigned n = width - x;
+            if (y == height)
+                return -1;
+            if (n > run)
+                n = run;
+            /* a plain loop, so the host tools need nothing from libcutils;
+             * the compiler vectorizes it */
+            for (i = 0; i < n; i++)
+                row[x + i] = color;
+            run -= n;
+            x += n;
+            if (x == width) {
+                x = 0;
+                y++;
+                row += stride;
+            }
+        }
+    }
+    return (y == height && x == 0 && words == 0) ? 0 : -1;
+}
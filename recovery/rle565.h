@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef RLE565_H
+#define RLE565_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Run-length encoded RGB 565, the format written by "rgb2565 -rle" and used
+ * for initlogo.rle: a sequence of (count, color) pairs of native-endian
+ * 16-bit words. Runs are laid out in raster order and may span rows.
+ */
+
+/* Encode count pixels into out, which holds out_words 16-bit words.
+ * Returns the number of words written, or 0 if out is too small. */
+size_t rle565_encode(const uint16_t *pixels, size_t count,
+                     uint16_t *out, size_t out_words);
+
+/* Expand an image of width x height pixels into dst, whose rows are stride
+ * pixels apart, e.g. straight into a mapped framebuffer. Returns 0, or -1
+ * if the data does not describe exactly width x height pixels. */
+int rle565_decode(const uint16_t *rle, size_t words,
+                  uint16_t *dst, int width, int height, int stride);
+
+#endif // RLE565_H
@@ -38,5 +38,55 @@ LOCAL_MODULE:= btconfig
 
 include $(BUILD_EXECUTABLE)
 
+#
+# btconfig_sim_test: btconfig's command engine and connection table against
+# the simulated controller, on the host
+#
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= tests/btconfig_sim_test.c
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/tests/include
+
+LOCAL_LDLIBS := -lpthread -lrt
+
+LOCAL_MODULE_TAGS := tests
+LOCAL_MODULE:= btconfig_sim_test
+
+include $(BUILD_HOST_EXECUTABLE)
+
+#
+# partsize: flash footprint of the built images against the board budgets
+#
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= partsize.c
+
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE:= partsize
+
+include $(BUILD_HOST_EXECUTABLE)
+
+PARTSIZE := $(HOST_OUT_EXECUTABLES)/partsize$(HOST_EXECUTABLE_SUFFIX)
+
+# Every full build ("make" or "make droid") checks the images against
+# their partitions: it warns once one is PARTITION_BUDGET_WARN percent
+# full and fails if one has outgrown its partition. "make partition-budget"
+# runs the check alone. The recipe is expanded late, after core/Makefile
+# has defined the INSTALLED_* image paths.
+PARTITION_BUDGET_WARN ?= 90
+
+.PHONY: partition-budget
+partition-budget: $(PARTSIZE) bootimage recoveryimage systemimage
+	$(hide) $(PARTSIZE) -b $(BOARD_FLASH_BLOCK_SIZE) \
+		-w $(PARTITION_BUDGET_WARN) \
+		system=$(BOARD_SYSTEMIMAGE_PARTITION_SIZE):$(TARGET_OUT) \
+		boot=$(BOARD_BOOTIMAGE_PARTITION_SIZE):$(INSTALLED_BOOTIMAGE_TARGET) \
+		recovery=$(BOARD_RECOVERYIMAGE_PARTITION_SIZE):$(INSTALLED_RECOVERYIMAGE_TARGET)
+
+droid: partition-budget
+
 endif # not BUILD_TINY_ANDROID
 endif # TARGET_DEVICE
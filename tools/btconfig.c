@@ -19,7 +19,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <bluetooth/bluetooth.h>
@@ -29,14 +36,409 @@
 
 #include <bluedroid/bluetooth.h>
 
-static void usage(void);
+/*
+ * Where HCI traffic goes: the real controller on hci0, or a simulated one
+ * answering from the other end of a socketpair (see --sim in usage).
+ */
+struct hci_transport {
+    const char *name;
+    int (*open)(void);
+    int (*set_filter)(int sock, struct hci_filter *flt);
+    int (*get_conn_list)(int sock, struct hci_conn_list_req *req);
+};
+
+static const struct hci_transport *transport;
+
+static void usage(FILE *out);
+
+/*
+ * ACL connections by remote address. Loaded once with HCIGETCONNLIST and
+ * then kept current from Connection Complete and Disconnection Complete
+ * events, so lookups never go back to the kernel. Open addressing with
+ * linear probing; the table doubles once it is half full.
+ */
+
+struct conn_entry {
+    bdaddr_t bdaddr;
+    uint16_t handle;
+    uint8_t used;
+};
+
+struct conn_table {
+    int loaded;
+    int count;
+    int size;               /* always a power of two */
+    struct conn_entry *entries;
+};
 
-int vendor_sleep(int fd) {
+static unsigned int conn_hash(const bdaddr_t *ba) {
+    const uint8_t *b = ba->b;
+    /* the low three bytes (LAP) differ the most between devices */
+    return (b[0] | (b[1] << 8) | (b[2] << 16)) ^ ((b[3] | (b[4] << 8)) << 5);
+}
+
+static struct conn_entry *conn_table_find(struct conn_table *t,
+        const bdaddr_t *ba) {
+    unsigned int i;
+
+    if (!t->size)
+        return NULL;
+    for (i = conn_hash(ba) & (t->size - 1); t->entries[i].used;
+            i = (i + 1) & (t->size - 1)) {
+        if (!bacmp(&t->entries[i].bdaddr, ba))
+            return &t->entries[i];
+    }
+    return NULL;
+}
+
+static int conn_table_insert(struct conn_table *t, const bdaddr_t *ba,
+        uint16_t handle) {
+    struct conn_entry *e;
+    unsigned int i;
+
+    if ((t->count + 1) * 2 > t->size) {
+        struct conn_entry *old = t->entries;
+        int old_size = t->size;
+        int n;
+
+        t->size = t->size ? t->size * 2 : 16;
+        t->entries = calloc(t->size, sizeof(*t->entries));
+        if (!t->entries) {
+            t->entries = old;
+            t->size = old_size;
+            return -1;
+        }
+        t->count = 0;
+        for (n = 0; n < old_size; n++) {
+            if (old[n].used)
+                conn_table_insert(t, &old[n].bdaddr, old[n].handle);
+        }
+        free(old);
+    }
+
+    e = conn_table_find(t, ba);
+    if (!e) {
+        for (i = conn_hash(ba) & (t->size - 1); t->entries[i].used;
+                i = (i + 1) & (t->size - 1))
+            ;
+        e = &t->entries[i];
+        bacpy(&e->bdaddr, ba);
+        e->used = 1;
+        t->count++;
+    }
+    e->handle = handle;
+    return 0;
+}
+
+static void conn_table_remove(struct conn_table *t, uint16_t handle) {
+    unsigned int i, j, home;
+
+    for (i = 0; i < (unsigned int)t->size; i++) {
+        if (t->entries[i].used && t->entries[i].handle == handle)
+            break;
+    }
+    if (i == (unsigned int)t->size)
+        return;
+
+    /* shift later members of the probe run back so lookups still work */
+    t->entries[i].used = 0;
+    t->count--;
+    for (j = (i + 1) & (t->size - 1); t->entries[j].used;
+            j = (j + 1) & (t->size - 1)) {
+        home = conn_hash(&t->entries[j].bdaddr) & (t->size - 1);
+        if (((j - home) & (t->size - 1)) >= ((j - i) & (t->size - 1))) {
+            t->entries[i] = t->entries[j];
+            t->entries[j].used = 0;
+            i = j;
+        }
+    }
+}
+
+static int conn_table_load(struct conn_table *t, int fd, FILE *out) {
+    struct hci_conn_list_req *conn_list;
+    struct hci_conn_info *conn_info;
+    int max_conn = 16;
+    int i;
+
+    /* grow the request until the kernel has room to spare */
+    for (;;) {
+        conn_list = malloc(sizeof(struct hci_conn_list_req) +
+                max_conn * sizeof(struct hci_conn_info));
+        if (!conn_list) {
+            fprintf(out, "Out of memory in %s\n", __FUNCTION__);
+            return -1;
+        }
+
+        conn_list->dev_id = 0;  /* hardcoded to HCI device 0 */
+        conn_list->conn_num = max_conn;
+
+        if (transport->get_conn_list(fd, conn_list)) {
+            fprintf(out, "Failed to get connection list\n");
+            free(conn_list);
+            return -1;
+        }
+        if (conn_list->conn_num < max_conn)
+            break;
+        free(conn_list);
+        max_conn *= 2;
+    }
+
+    for (i = 0; i < conn_list->conn_num; i++) {
+        conn_info = &conn_list->conn_info[i];
+        if (conn_info->type == ACL_LINK &&
+                conn_table_insert(t, &conn_info->bdaddr, conn_info->handle)) {
+            fprintf(out, "Out of memory in %s\n", __FUNCTION__);
+            free(conn_list);
+            return -1;
+        }
+    }
+    free(conn_list);
+    t->loaded = 1;
+    return 0;
+}
+
+static void conn_table_free(struct conn_table *t) {
+    free(t->entries);
+    memset(t, 0, sizeof(*t));
+}
+
+/*
+ * Command engine: commands are written as soon as they are queued and the
+ * kernel paces them against the controller's command credits, so several
+ * can be in flight. Completion is matched by opcode, oldest first, against
+ * Command Complete/Command Status events and reported with the round-trip
+ * time.
+ */
+
+#define HCI_CMD_TIMEOUT_MS  2000
+#define MAX_PENDING_CMDS    16
+
+struct hci_cmd {
+    int tag;                /* batch line that queued the command */
+    uint16_t opcode;
+    int64_t sent_us;
+};
+
+struct hci_engine {
+    int sock;
+    int tag;
+    FILE *out;
+    int failed;
+    int npending;
+    struct hci_cmd pending[MAX_PENDING_CMDS];
+    struct conn_table conns;
+};
+
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Only let through the events the engine handles, or with all set, every
+ * packet in both directions for the traffic monitors. */
+static int hci_set_filter(struct hci_engine *eng, int all) {
+    struct hci_filter flt;
+
+    hci_filter_clear(&flt);
+    if (all) {
+        hci_filter_all_ptypes(&flt);
+        hci_filter_all_events(&flt);
+    } else {
+        hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+        hci_filter_set_event(EVT_CMD_COMPLETE, &flt);
+        hci_filter_set_event(EVT_CMD_STATUS, &flt);
+        hci_filter_set_event(EVT_CONN_COMPLETE, &flt);
+        hci_filter_set_event(EVT_DISCONN_COMPLETE, &flt);
+    }
+    if (transport->set_filter(eng->sock, &flt) < 0) {
+        fprintf(eng->out, "Error setting HCI filter. %s(%d)\n", strerror(errno), errno);
+        return -1;
+    }
+    return 0;
+}
+
+static int hci_engine_init(struct hci_engine *eng, int sock) {
+    memset(eng, 0, sizeof(*eng));
+    eng->sock = sock;
+    eng->out = stdout;
+
+    return hci_set_filter(eng, 0);
+}
+
+static void hci_cmd_done(struct hci_engine *eng, int i, int status) {
+    struct hci_cmd *cmd = &eng->pending[i];
+    int64_t rtt = now_us() - cmd->sent_us;
+
+    if (status < 0) {
+        fprintf(eng->out, "%d opcode 0x%04x: timed out\n",
+                cmd->tag, cmd->opcode);
+        eng->failed++;
+    } else {
+        fprintf(eng->out, "%d opcode 0x%04x: %s (status 0x%02x, %lld us)\n",
+                cmd->tag, cmd->opcode, status ? "failed" : "ok", status,
+                (long long)rtt);
+        if (status)
+            eng->failed++;
+    }
+    fflush(eng->out);
+
+    eng->npending--;
+    memmove(&eng->pending[i], &eng->pending[i + 1],
+            (eng->npending - i) * sizeof(eng->pending[0]));
+}
+
+static void hci_match(struct hci_engine *eng, uint16_t opcode, int status) {
+    int i;
+
+    for (i = 0; i < eng->npending; i++) {
+        if (eng->pending[i].opcode == opcode) {
+            hci_cmd_done(eng, i, status);
+            return;
+        }
+    }
+    /* someone else's command, e.g. from the stack */
+}
+
+static int hci_read_event(struct hci_engine *eng) {
+    unsigned char buf[HCI_MAX_EVENT_SIZE];
+    hci_event_hdr *hdr = (hci_event_hdr *)(buf + 1);
+    unsigned char *ptr = buf + 1 + HCI_EVENT_HDR_SIZE;
+    int len;
+
+    len = read(eng->sock, buf, sizeof(buf));
+    if (len < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return 0;
+        fprintf(eng->out, "read(): %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+    if (len < 1 + HCI_EVENT_HDR_SIZE || buf[0] != HCI_EVENT_PKT)
+        return 0;
+    len -= 1 + HCI_EVENT_HDR_SIZE;
+
+    switch (hdr->evt) {
+    case EVT_CMD_COMPLETE:
+        if (len >= EVT_CMD_COMPLETE_SIZE) {
+            evt_cmd_complete *cc = (evt_cmd_complete *)ptr;
+            /* the first return parameter is the status for our commands */
+            hci_match(eng, btohs(cc->opcode),
+                    len > EVT_CMD_COMPLETE_SIZE ?
+                    ptr[EVT_CMD_COMPLETE_SIZE] : 0);
+        }
+        break;
+    case EVT_CMD_STATUS:
+        if (len >= EVT_CMD_STATUS_SIZE) {
+            evt_cmd_status *cs = (evt_cmd_status *)ptr;
+            hci_match(eng, btohs(cs->opcode), cs->status);
+        }
+        break;
+    case EVT_CONN_COMPLETE:
+        if (len >= EVT_CONN_COMPLETE_SIZE && eng->conns.loaded) {
+            evt_conn_complete *cc = (evt_conn_complete *)ptr;
+            if (!cc->status && cc->link_type == ACL_LINK)
+                conn_table_insert(&eng->conns, &cc->bdaddr,
+                        btohs(cc->handle));
+        }
+        break;
+    case EVT_DISCONN_COMPLETE:
+        if (len >= EVT_DISCONN_COMPLETE_SIZE && eng->conns.loaded) {
+            evt_disconn_complete *dc = (evt_disconn_complete *)ptr;
+            if (!dc->status)
+                conn_table_remove(&eng->conns, btohs(dc->handle));
+        }
+        break;
+    }
+    return 0;
+}
+
+/* Handle whatever events are already queued without blocking. */
+static int hci_poll_events(struct hci_engine *eng) {
+    struct pollfd pfd;
+
+    pfd.fd = eng->sock;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+        if (hci_read_event(eng) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Wait until no more than max commands are outstanding. */
+static int hci_wait_cmds(struct hci_engine *eng, int max) {
+    struct pollfd pfd;
+    int timeout;
+
+    while (eng->npending > max) {
+        timeout = (int)((eng->pending[0].sent_us +
+                HCI_CMD_TIMEOUT_MS * 1000LL - now_us()) / 1000);
+        if (timeout <= 0) {
+            hci_cmd_done(eng, 0, -1);
+            continue;
+        }
+
+        pfd.fd = eng->sock;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(eng->out, "poll(): %s (%d)\n", strerror(errno), errno);
+            return -1;
+        }
+        if ((pfd.revents & POLLIN) && hci_read_event(eng) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Send a raw HCI command packet and track it until it completes. */
+static int hci_send_cmd(struct hci_engine *eng, unsigned char *pkt, int len) {
+    struct hci_cmd *cmd;
+    int ret;
+
+    if (eng->npending == MAX_PENDING_CMDS &&
+            hci_wait_cmds(eng, MAX_PENDING_CMDS - 1) < 0)
+        return -1;
+
+    ret = write(eng->sock, pkt, len);
+    if (ret < 0) {
+        fprintf(eng->out, "write(): %s (%d)]\n", strerror(errno), errno);
+        return -1;
+    } else if (ret != len) {
+        fprintf(eng->out, "write(): unexpected length %d\n", ret);
+        return -1;
+    }
+
+    cmd = &eng->pending[eng->npending++];
+    cmd->tag = eng->tag;
+    cmd->opcode = pkt[1] | (pkt[2] << 8);
+    cmd->sent_us = now_us();
+    return 0;
+}
+
+/* sleep parameters that can be overridden as key=value, by byte offset */
+static const struct {
+    const char *name;
+    int offset;
+} sleep_params[] = {
+    { "mode", 4 },
+    { "host_idle", 5 },
+    { "hc_idle", 6 },
+    { "wake_pol", 7 },
+    { "host_wake_pol", 8 },
+    { "sco_sleep", 9 },
+    { "combine", 10 },
+    { "tristate", 11 },
+    { NULL, 0 },
+};
+
+int vendor_sleep(struct hci_engine *eng, int argc, char **argv) {
     unsigned char hci_sleep_cmd[] = {
         0x01,               // HCI command packet
         0x27, 0xfc,         // HCI_Set_Sleep_Mode_Param
         0x0c,               // 12 arguments
-        0x01,               // ??
+        0x01,               // Sleep mode (1 = UART)
         0x01,               // idle threshold Host (x300ms)
         0x01,               // idle threadhold HC (x300ms)
         0x01,               // WAKE active high
@@ -46,19 +448,27 @@ int vendor_sleep(int fd) {
         0x00,               // Enable tristate control of uart TX
         0x00, 0x00, 0x00, 0x00,
     };
+    char *value;
+    int i, n;
 
-    int ret = write(fd, hci_sleep_cmd, sizeof(hci_sleep_cmd));
-    if (ret < 0) {
-        printf("write(): %s (%d)]\n", strerror(errno), errno);
-        return -1;
-    } else if (ret != sizeof(hci_sleep_cmd)) {
-        printf("write(): unexpected length %d\n", ret);
-        return -1;
+    for (i = 0; i < argc; i++) {
+        value = strchr(argv[i], '=');
+        for (n = 0; value && sleep_params[n].name; n++) {
+            if (!strncmp(argv[i], sleep_params[n].name, value - argv[i]) &&
+                    !sleep_params[n].name[value - argv[i]])
+                break;
+        }
+        if (!value || !sleep_params[n].name) {
+            fprintf(eng->out, "Unknown sleep parameter %s\n", argv[i]);
+            return -1;
+        }
+        hci_sleep_cmd[sleep_params[n].offset] = strtol(value + 1, NULL, 0);
     }
-    return 0;
+
+    return hci_send_cmd(eng, hci_sleep_cmd, sizeof(hci_sleep_cmd));
 }
 
-int vendor_high_priority(int fd, unsigned char acl) {
+int vendor_high_priority(struct hci_engine *eng, uint16_t acl) {
     unsigned char hci_sleep_cmd[] = {
         0x01,               // HCI command packet
         0x57, 0xfc,         // HCI_Write_High_Priority_Connection
@@ -66,17 +476,72 @@ int vendor_high_priority(int fd, unsigned char acl) {
         0x00, 0x00          // Handle
     };
 
-    hci_sleep_cmd[4] = acl;
+    hci_sleep_cmd[4] = acl & 0xff;
+    hci_sleep_cmd[5] = acl >> 8;
 
-    int ret = write(fd, hci_sleep_cmd, sizeof(hci_sleep_cmd));
-    if (ret < 0) {
-        printf("write(): %s (%d)]\n", strerror(errno), errno);
-        return -1;
-    } else if (ret != sizeof(hci_sleep_cmd)) {
-        printf("write(): unexpected length %d\n", ret);
-        return -1;
-    }
-    return 0;
+    return hci_send_cmd(eng, hci_sleep_cmd, sizeof(hci_sleep_cmd));
+}
+
+int write_flush_timeout(struct hci_engine *eng, uint16_t acl, uint16_t slots) {
+    unsigned char hci_cmd[] = {
+        0x01,               // HCI command packet
+        0x28, 0x0c,         // HCI_Write_Automatic_Flush_Timeout
+        0x04,               // Length
+        0x00, 0x00,         // Handle
+        0x00, 0x00,         // Timeout (x0.625ms, 0 = never flush)
+    };
+
+    hci_cmd[4] = acl & 0xff;
+    hci_cmd[5] = acl >> 8;
+    hci_cmd[6] = slots & 0xff;
+    hci_cmd[7] = slots >> 8;
+
+    return hci_send_cmd(eng, hci_cmd, sizeof(hci_cmd));
+}
+
+int write_supervision_timeout(struct hci_engine *eng, uint16_t acl,
+        uint16_t slots) {
+    unsigned char hci_cmd[] = {
+        0x01,               // HCI command packet
+        0x37, 0x0c,         // HCI_Write_Link_Supervision_Timeout
+        0x04,               // Length
+        0x00, 0x00,         // Handle
+        0x00, 0x00,         // Timeout (x0.625ms)
+    };
+
+    hci_cmd[4] = acl & 0xff;
+    hci_cmd[5] = acl >> 8;
+    hci_cmd[6] = slots & 0xff;
+    hci_cmd[7] = slots >> 8;
+
+    return hci_send_cmd(eng, hci_cmd, sizeof(hci_cmd));
+}
+
+int sniff_mode(struct hci_engine *eng, uint16_t acl, uint16_t max_interval,
+        uint16_t min_interval, uint16_t attempt, uint16_t timeout) {
+    unsigned char hci_cmd[] = {
+        0x01,               // HCI command packet
+        0x03, 0x08,         // HCI_Sniff_Mode
+        0x0a,               // Length
+        0x00, 0x00,         // Handle
+        0x00, 0x00,         // Max interval (x0.625ms)
+        0x00, 0x00,         // Min interval (x0.625ms)
+        0x00, 0x00,         // Attempt (x1.25ms)
+        0x00, 0x00,         // Timeout (x1.25ms)
+    };
+
+    hci_cmd[4] = acl & 0xff;
+    hci_cmd[5] = acl >> 8;
+    hci_cmd[6] = max_interval & 0xff;
+    hci_cmd[7] = max_interval >> 8;
+    hci_cmd[8] = min_interval & 0xff;
+    hci_cmd[9] = min_interval >> 8;
+    hci_cmd[10] = attempt & 0xff;
+    hci_cmd[11] = attempt >> 8;
+    hci_cmd[12] = timeout & 0xff;
+    hci_cmd[13] = timeout >> 8;
+
+    return hci_send_cmd(eng, hci_cmd, sizeof(hci_cmd));
 }
 
 int get_hci_sock() {
@@ -109,138 +574,1007 @@ int get_hci_sock() {
     return sock;
 }
 
-static int get_acl_handle(int fd, bdaddr_t bdaddr) {
-    int i;
-    int ret = -1;
-    struct hci_conn_list_req *conn_list;
-    struct hci_conn_info *conn_info;
-    int max_conn = 10;
+static int hci0_set_filter(int sock, struct hci_filter *flt) {
+    return setsockopt(sock, SOL_HCI, HCI_FILTER, flt, sizeof(*flt));
+}
 
-    conn_list = malloc(max_conn * (
-            sizeof(struct hci_conn_list_req) + sizeof(struct hci_conn_info)));
-    if (!conn_list) {
-        printf("Out of memory in %s\n", __FUNCTION__);
-        return -1;
+static int hci0_get_conn_list(int sock, struct hci_conn_list_req *req) {
+    return ioctl(sock, HCIGETCONNLIST, (void *)req);
+}
+
+static const struct hci_transport hci0_transport = {
+    "hci0", get_hci_sock, hci0_set_filter, hci0_get_conn_list,
+};
+
+/*
+ * Simulated controller: a thread reads commands from one end of a
+ * SOCK_SEQPACKET socketpair and answers each one sim_latency_ms after it
+ * arrived, with Command Status (link control and link policy commands,
+ * which complete asynchronously on a real controller) or a successful
+ * Command Complete. Commands in flight overlap like they do on a real
+ * controller, so pipelining shows up in the timings. It reports sim_links
+ * ACL connections with handles 1..n and addresses 00:00:00:00:00:01 and up.
+ */
+
+#define SIM_MAX_QUEUED      64
+
+struct sim_reply {
+    int64_t due_us;
+    int len;
+    unsigned char evt[8];
+};
+
+static int sim_latency_ms = 1;
+static int sim_links = 4;
+
+static void *sim_controller(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    unsigned char cmd[HCI_MAX_FRAME_SIZE];
+    struct sim_reply queue[SIM_MAX_QUEUED];
+    struct sim_reply *r;
+    struct pollfd pfd;
+    int head = 0, count = 0;
+    uint16_t opcode;
+    int64_t now;
+    int len, timeout;
+
+    for (;;) {
+        /* answer everything that is due, oldest first */
+        now = now_us();
+        while (count && queue[head].due_us <= now) {
+            r = &queue[head];
+            if (write(fd, r->evt, r->len) != r->len)
+                goto out;
+            head = (head + 1) % SIM_MAX_QUEUED;
+            count--;
+        }
+        timeout = count ? (int)((queue[head].due_us - now + 999) / 1000) : -1;
+
+        pfd.fd = fd;
+        pfd.events = count < SIM_MAX_QUEUED ? POLLIN : 0;
+        if (poll(&pfd, 1, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (!(pfd.revents & POLLIN)) {
+            if (pfd.revents & (POLLHUP | POLLERR))
+                break;
+            continue;
+        }
+
+        len = read(fd, cmd, sizeof(cmd));
+        if (len <= 0)
+            break;
+        if (len < 1 + HCI_COMMAND_HDR_SIZE || cmd[0] != HCI_COMMAND_PKT)
+            continue;
+
+        r = &queue[(head + count++) % SIM_MAX_QUEUED];
+        r->due_us = now_us() + sim_latency_ms * 1000LL;
+        opcode = cmd[1] | (cmd[2] << 8);
+        r->evt[0] = HCI_EVENT_PKT;
+        if (cmd_opcode_ogf((opcode)) == OGF_LINK_CTL ||
+                cmd_opcode_ogf((opcode)) == OGF_LINK_POLICY) {
+            r->evt[1] = EVT_CMD_STATUS;
+            r->evt[2] = EVT_CMD_STATUS_SIZE;
+            r->evt[3] = 0x00;       // Status
+            r->evt[4] = 0x01;       // Num_HCI_Command_Packets
+            r->evt[5] = cmd[1];
+            r->evt[6] = cmd[2];
+            r->len = 7;
+        } else {
+            r->evt[1] = EVT_CMD_COMPLETE;
+            r->evt[2] = EVT_CMD_COMPLETE_SIZE + 1;
+            r->evt[3] = 0x01;       // Num_HCI_Command_Packets
+            r->evt[4] = cmd[1];
+            r->evt[5] = cmd[2];
+            r->evt[6] = 0x00;       // Status
+            r->len = 7;
+        }
     }
+out:
+    close(fd);
+    return NULL;
+}
 
-    conn_list->dev_id = 0;  /* hardcoded to HCI device 0 */
-    conn_list->conn_num = max_conn;
+static int sim_open(void) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    int fds[2];
 
-    if (ioctl(fd, HCIGETCONNLIST, (void *)conn_list)) {
-        printf("Failed to get connection list\n");
-        goto out;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0) {
+        printf("socketpair(): %s (%d)\n", strerror(errno), errno);
+        return -1;
     }
 
-    for (i=0; i < conn_list->conn_num; i++) {
-        conn_info = &conn_list->conn_info[i];
-        if (conn_info->type == ACL_LINK &&
-                !memcmp((void *)&conn_info->bdaddr, (void *)&bdaddr,
-                sizeof(bdaddr_t))) {
-            ret = conn_info->handle;
-            goto out;
-        }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, sim_controller,
+            (void *)(intptr_t)fds[1])) {
+        printf("Can't start simulated controller\n");
+        close(fds[0]);
+        close(fds[1]);
+        fds[0] = -1;
     }
-    ret = 0;
+    pthread_attr_destroy(&attr);
 
-out:
-    free(conn_list);
-    return ret;
+    printf("Using simulated controller (%dms latency, %d links).\n",
+            sim_latency_ms, sim_links);
+    return fds[0];
 }
 
-static int do_sleep(int argc, char **argv) {
-    int ret;
-    int sock = get_hci_sock();
+static int sim_set_filter(int sock, struct hci_filter *flt) {
+    (void)sock;
+    (void)flt;
+    return 0;
+}
+
+static int sim_get_conn_list(int sock, struct hci_conn_list_req *req) {
+    int i, n = sim_links < req->conn_num ? sim_links : req->conn_num;
+
+    (void)sock;
+    for (i = 0; i < n; i++) {
+        struct hci_conn_info *ci = &req->conn_info[i];
+        memset(ci, 0, sizeof(*ci));
+        ci->handle = i + 1;
+        ci->bdaddr.b[0] = (i + 1) & 0xff;
+        ci->bdaddr.b[1] = (i + 1) >> 8;
+        ci->type = ACL_LINK;
+    }
+    req->conn_num = n;
+    return 0;
+}
 
-    if (sock < 0)
-        return sock;
+static const struct hci_transport sim_transport = {
+    "sim", sim_open, sim_set_filter, sim_get_conn_list,
+};
 
-    ret = vendor_sleep(sock);
-    close(sock);
+static int get_acl_handle(struct hci_engine *eng, bdaddr_t bdaddr) {
+    struct conn_entry *e;
+    char addr[18];
 
-    return ret;
+    if (!eng->conns.loaded) {
+        if (conn_table_load(&eng->conns, eng->sock, eng->out) < 0)
+            return -1;
+    } else if (hci_poll_events(eng) < 0) {
+        return -1;
+    }
+
+    e = conn_table_find(&eng->conns, &bdaddr);
+    if (!e) {
+        ba2str(&bdaddr, addr);
+        fprintf(eng->out, "No ACL connection to %s\n", addr);
+        return -1;
+    }
+    return e->handle;
 }
 
-static int do_high_priority(int argc, char **argv) {
-    int ret;
-    int sock = get_hci_sock();
-    unsigned char acl;
+static int do_sleep(struct hci_engine *eng, int argc, char **argv) {
+    return vendor_sleep(eng, argc, argv);
+}
 
-    if (sock < 0)
-        return sock;
+static int do_high_priority(struct hci_engine *eng, int argc, char **argv) {
+    uint16_t acl;
 
     if (argc != 1) {
-        usage();
+        usage(eng->out);
         return -1;
     }
 
-    acl = (unsigned char)atoi(argv[0]);
-
-    ret = vendor_high_priority(sock, acl);
-    close(sock);
+    acl = (uint16_t)atoi(argv[0]);
 
-    return ret;
+    return vendor_high_priority(eng, acl);
 }
 
-static int do_high_priority_address(int argc, char **argv) {
+static int do_high_priority_address(struct hci_engine *eng,
+        int argc, char **argv) {
     int ret;
-    int sock = get_hci_sock();
-    unsigned char acl;
     bdaddr_t bdaddr;
 
-    if (sock < 0)
-        return sock;
-
     if (argc != 1) {
-        usage();
+        usage(eng->out);
         return -1;
     }
 
     str2ba(argv[0], &bdaddr);
 
-    ret = get_acl_handle(sock, bdaddr);
-    if (ret < 0) goto out;
+    ret = get_acl_handle(eng, bdaddr);
+    if (ret < 0)
+        return ret;
 
-    ret = vendor_high_priority(sock, ret);
+    return vendor_high_priority(eng, ret);
+}
 
-out:
-    close(sock);
+/*
+ * Link QoS profiles. A profile is a set of key=value settings, either one
+ * of the presets below or read from a file (one setting per line, '#'
+ * starts a comment). Settings left out are not touched on the link.
+ *
+ *   priority=1                     Write_High_Priority_Connection
+ *   flush_timeout=<ms>             Write_Automatic_Flush_Timeout (0 = never)
+ *   supervision_timeout=<ms>       Write_Link_Supervision_Timeout
+ *   sniff=<max>,<min>,<attempt>,<timeout>
+ *                                  Sniff_Mode, intervals in slots (0.625ms)
+ */
 
+struct qos_profile {
+    int priority;
+    int flush_timeout;
+    int supervision_timeout;
+    int sniff[4];
+};
+
+static const struct {
+    const char *name;
+    const char *settings;
+} qos_presets[] = {
+    /* A2DP next to WiFi on the bcm4329: favour the audio link and drop
+     * stale packets instead of retransmitting them until the stream
+     * stutters */
+    { "a2dp", "priority=1 flush_timeout=200 supervision_timeout=2000" },
+    { "hid", "supervision_timeout=2000 sniff=24,12,2,1" },
+    { NULL, NULL },
+};
+
+#define MAX_QOS_FILTER  16
+
+static int parse_qos_setting(struct qos_profile *qos, char *setting,
+        FILE *out) {
+    char *value = strchr(setting, '=');
+
+    if (!value)
+        return -1;
+    *value++ = '\0';
+
+    if (!strcmp(setting, "priority")) {
+        qos->priority = atoi(value);
+    } else if (!strcmp(setting, "flush_timeout")) {
+        qos->flush_timeout = atoi(value);
+    } else if (!strcmp(setting, "supervision_timeout")) {
+        qos->supervision_timeout = atoi(value);
+    } else if (!strcmp(setting, "sniff")) {
+        if (sscanf(value, "%d,%d,%d,%d", &qos->sniff[0], &qos->sniff[1],
+                &qos->sniff[2], &qos->sniff[3]) != 4 ||
+                qos->sniff[1] > qos->sniff[0]) {
+            fprintf(out, "Bad sniff parameters %s\n", value);
+            return -1;
+        }
+    } else {
+        fprintf(out, "Unknown QoS setting %s\n", setting);
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_qos_settings(struct qos_profile *qos, char *settings,
+        FILE *out) {
+    char *tok, *save;
+
+    for (tok = strtok_r(settings, " \t\r\n", &save); tok && tok[0] != '#';
+            tok = strtok_r(NULL, " \t\r\n", &save)) {
+        if (parse_qos_setting(qos, tok, out) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int load_qos_profile(struct qos_profile *qos, const char *name,
+        FILE *out) {
+    char line[256];
+    FILE *f;
+    int i, ret = 0;
+
+    memset(qos, 0, sizeof(*qos));
+    qos->flush_timeout = -1;
+    qos->supervision_timeout = -1;
+    qos->sniff[0] = -1;
+
+    for (i = 0; qos_presets[i].name; i++) {
+        if (!strcmp(name, qos_presets[i].name)) {
+            strncpy(line, qos_presets[i].settings, sizeof(line) - 1);
+            line[sizeof(line) - 1] = '\0';
+            return parse_qos_settings(qos, line, out);
+        }
+    }
+
+    f = fopen(name, "r");
+    if (!f) {
+        fprintf(out, "No QoS preset or profile file %s\n", name);
+        return -1;
+    }
+    while (ret == 0 && fgets(line, sizeof(line), f))
+        ret = parse_qos_settings(qos, line, out);
+    fclose(f);
     return ret;
 }
 
+/* ms to baseband slots of 0.625ms */
+static uint16_t ms_to_slots(int ms) {
+    int slots = ms * 8 / 5;
+    return slots > 0xffff ? 0xffff : slots;
+}
+
+static int apply_qos(struct hci_engine *eng, struct qos_profile *qos,
+        uint16_t handle) {
+    int ret = 0;
+
+    if (qos->priority)
+        ret |= vendor_high_priority(eng, handle);
+    if (qos->flush_timeout >= 0)
+        ret |= write_flush_timeout(eng, handle,
+                ms_to_slots(qos->flush_timeout));
+    if (qos->supervision_timeout >= 0)
+        ret |= write_supervision_timeout(eng, handle,
+                ms_to_slots(qos->supervision_timeout));
+    if (qos->sniff[0] >= 0)
+        ret |= sniff_mode(eng, handle, qos->sniff[0], qos->sniff[1],
+                qos->sniff[2], qos->sniff[3]);
+    return ret ? -1 : 0;
+}
+
+/* qos <preset|file> [key=value ...] [bdaddr ...]: apply a profile to the
+ * given links, or to every ACL link when no address is given */
+static int do_qos(struct hci_engine *eng, int argc, char **argv) {
+    struct qos_profile qos;
+    bdaddr_t filter[MAX_QOS_FILTER];
+    struct conn_entry *e;
+    char addr[18];
+    int nfilter = 0;
+    int i, n, applied = 0, ret = 0;
+
+    if (argc < 1) {
+        usage(eng->out);
+        return -1;
+    }
+    if (load_qos_profile(&qos, argv[0], eng->out) < 0)
+        return -1;
+
+    for (i = 1; i < argc; i++) {
+        if (strchr(argv[i], '=')) {
+            if (parse_qos_setting(&qos, argv[i], eng->out) < 0)
+                return -1;
+        } else if (bachk(argv[i]) < 0) {
+            fprintf(eng->out, "Bad address %s\n", argv[i]);
+            return -1;
+        } else if (nfilter == MAX_QOS_FILTER) {
+            fprintf(eng->out, "At most %d addresses\n", MAX_QOS_FILTER);
+            return -1;
+        } else {
+            str2ba(argv[i], &filter[nfilter++]);
+        }
+    }
+
+    if (!eng->conns.loaded) {
+        if (conn_table_load(&eng->conns, eng->sock, eng->out) < 0)
+            return -1;
+    } else if (hci_poll_events(eng) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < eng->conns.size; i++) {
+        e = &eng->conns.entries[i];
+        if (!e->used)
+            continue;
+        for (n = 0; n < nfilter; n++) {
+            if (!bacmp(&e->bdaddr, &filter[n]))
+                break;
+        }
+        if (nfilter && n == nfilter)
+            continue;
+
+        ba2str(&e->bdaddr, addr);
+        fprintf(eng->out, "Applying %s to %s (handle 0x%04x)\n", argv[0], addr,
+                e->handle);
+        if (apply_qos(eng, &qos, e->handle) < 0)
+            ret = -1;
+        applied++;
+    }
+
+    if (!applied) {
+        fprintf(eng->out, "No matching ACL links\n");
+        return -1;
+    }
+    return ret;
+}
+
+/*
+ * LPM profiling: watch all HCI traffic for a while and work out which idle
+ * threshold would have cost the least. With threshold T the UART stays up
+ * for T after the last packet, so a gap g between packets costs min(g, T)
+ * of awake time and, if g > T, one more wakeup. Each wakeup is charged
+ * wake_cost ms on top, covering the HOST_WAKE/WAKE handshake.
+ */
+
+#define LPM_MAX_GAP_MS      8192    /* 1ms histogram bins */
+#define LPM_MAX_STEPS       16
+
+static int do_lpm(struct hci_engine *eng, int argc, char **argv) {
+    unsigned char buf[HCI_MAX_FRAME_SIZE];
+    struct pollfd pfd;
+    unsigned int *gaps;
+    int seconds = 10, unit = 300, wake_cost = 10;
+    int64_t start, end, last = 0, now;
+    long long best_cost = -1;
+    int best = 1;
+    int i, k, packets = 0;
+
+    for (i = 0; i < argc; i++) {
+        if (!strncmp(argv[i], "unit=", 5))
+            unit = atoi(argv[i] + 5);
+        else if (!strncmp(argv[i], "wake_cost=", 10))
+            wake_cost = atoi(argv[i] + 10);
+        else
+            seconds = atoi(argv[i]);
+    }
+    if (seconds <= 0 || unit <= 0 || unit * LPM_MAX_STEPS > LPM_MAX_GAP_MS) {
+        usage(eng->out);
+        return -1;
+    }
+
+    gaps = calloc(LPM_MAX_GAP_MS + 1, sizeof(*gaps));
+    if (!gaps) {
+        fprintf(eng->out, "Out of memory in %s\n", __FUNCTION__);
+        return -1;
+    }
+    if (hci_set_filter(eng, 1) < 0) {
+        free(gaps);
+        return -1;
+    }
+
+    fprintf(eng->out, "Sampling HCI traffic for %ds\n", seconds);
+    start = now_us();
+    end = start + seconds * 1000000LL;
+    pfd.fd = eng->sock;
+    pfd.events = POLLIN;
+    while ((now = now_us()) < end) {
+        if (poll(&pfd, 1, (int)((end - now) / 1000) + 1) <= 0)
+            continue;
+        if (read(eng->sock, buf, sizeof(buf)) <= 0)
+            continue;
+        now = now_us();
+        if (packets++) {
+            int64_t gap = (now - last) / 1000;
+            gaps[gap > LPM_MAX_GAP_MS ? LPM_MAX_GAP_MS : gap]++;
+        }
+        last = now;
+    }
+    hci_set_filter(eng, 0);
+
+    if (packets < 2) {
+        fprintf(eng->out, "Not enough traffic to profile (%d packets)\n", packets);
+        free(gaps);
+        return -1;
+    }
+
+    fprintf(eng->out, "%d packets, %.1f/s\n", packets, packets / (double)seconds);
+    fprintf(eng->out, "threshold  wakeups  awake\n");
+    for (k = 1; k <= LPM_MAX_STEPS; k++) {
+        int t = k * unit;
+        long long awake = t, wakeups = 1, cost;
+
+        for (i = 0; i <= LPM_MAX_GAP_MS; i++) {
+            if (!gaps[i])
+                continue;
+            awake += (long long)gaps[i] * (i < t ? i : t);
+            if (i > t)
+                wakeups += gaps[i];
+        }
+        cost = awake + wakeups * wake_cost;
+        fprintf(eng->out, "%6dms %8lld  %4.1f%%\n", t, wakeups,
+                100.0 * awake / (seconds * 1000.0));
+        if (best_cost < 0 || cost < best_cost) {
+            best_cost = cost;
+            best = k;
+        }
+    }
+    fprintf(eng->out, "Recommended: host_idle=%d hc_idle=%d (%dms)\n", best, best,
+            best * unit);
+
+    free(gaps);
+    return 0;
+}
+
+/*
+ * Traffic statistics: count every HCI packet in both directions and print
+ * a summary per interval. Commands are timed from when we see them go out
+ * to the matching Command Complete/Status. For each ACL handle we also
+ * keep the number of packets the controller has not yet reported as
+ * completed, which shows when it is backing up.
+ */
+
+#define STATS_MAX_OPCODES   64
+#define STATS_MAX_HANDLES   16
+#define STATS_LAT_BUCKETS   20      /* log2 buckets of microseconds */
+
+struct opcode_stats {
+    uint16_t opcode;
+    unsigned int count;
+    int64_t sent_us;                /* last time this opcode went out */
+    int64_t total_us;
+    int64_t max_us;
+    unsigned int lat[STATS_LAT_BUCKETS];
+};
+
+struct handle_stats {
+    uint16_t handle;
+    unsigned int rx_pkts, tx_pkts;
+    unsigned int rx_bytes, tx_bytes;
+    int outstanding;                /* not reset between intervals */
+    int max_outstanding;
+};
+
+struct hci_stats {
+    unsigned int pkts[2][5];        /* [incoming][packet type] */
+    unsigned int bytes[2][5];
+    int nopcodes;
+    struct opcode_stats opcodes[STATS_MAX_OPCODES];
+    int nhandles;
+    struct handle_stats handles[STATS_MAX_HANDLES];
+};
+
+static struct opcode_stats *stats_opcode(struct hci_stats *st,
+        uint16_t opcode) {
+    int i;
+
+    for (i = 0; i < st->nopcodes; i++) {
+        if (st->opcodes[i].opcode == opcode)
+            return &st->opcodes[i];
+    }
+    if (st->nopcodes == STATS_MAX_OPCODES)
+        return NULL;
+    st->opcodes[i].opcode = opcode;
+    return &st->opcodes[st->nopcodes++];
+}
+
+static struct handle_stats *stats_handle(struct hci_stats *st,
+        uint16_t handle) {
+    int i;
+
+    for (i = 0; i < st->nhandles; i++) {
+        if (st->handles[i].handle == handle)
+            return &st->handles[i];
+    }
+    if (st->nhandles == STATS_MAX_HANDLES)
+        return NULL;
+    st->handles[i].handle = handle;
+    return &st->handles[st->nhandles++];
+}
+
+static void stats_cmd_done(struct hci_stats *st, uint16_t opcode,
+        int64_t now) {
+    struct opcode_stats *op = stats_opcode(st, opcode);
+    int64_t lat;
+    int b = 0;
+
+    if (!op || !op->sent_us)
+        return;
+    lat = now - op->sent_us;
+    op->sent_us = 0;
+    op->count++;
+    op->total_us += lat;
+    if (lat > op->max_us)
+        op->max_us = lat;
+    while (b < STATS_LAT_BUCKETS - 1 && lat >= (2LL << b))
+        b++;
+    op->lat[b]++;
+}
+
+static void stats_packet(struct hci_stats *st, unsigned char *buf, int len,
+        int incoming, int64_t now) {
+    struct handle_stats *hs;
+    int type = buf[0];
+    int i, n;
+
+    if (type < HCI_COMMAND_PKT || type > HCI_EVENT_PKT)
+        type = 0;
+    st->pkts[incoming][type]++;
+    st->bytes[incoming][type] += len;
+
+    switch (type) {
+    case HCI_COMMAND_PKT:
+        if (!incoming && len >= 1 + HCI_COMMAND_HDR_SIZE) {
+            struct opcode_stats *op = stats_opcode(st, buf[1] | (buf[2] << 8));
+            if (op)
+                op->sent_us = now;
+        }
+        break;
+    case HCI_ACLDATA_PKT:
+        if (len < 1 + HCI_ACL_HDR_SIZE)
+            break;
+        hs = stats_handle(st, acl_handle((buf[1] | (buf[2] << 8))));
+        if (!hs)
+            break;
+        if (incoming) {
+            hs->rx_pkts++;
+            hs->rx_bytes += len;
+        } else {
+            hs->tx_pkts++;
+            hs->tx_bytes += len;
+            if (++hs->outstanding > hs->max_outstanding)
+                hs->max_outstanding = hs->outstanding;
+        }
+        break;
+    case HCI_EVENT_PKT:
+        if (len < 1 + HCI_EVENT_HDR_SIZE)
+            break;
+        if (buf[1] == EVT_CMD_COMPLETE && len >= 6) {
+            stats_cmd_done(st, buf[4] | (buf[5] << 8), now);
+        } else if (buf[1] == EVT_CMD_STATUS && len >= 7) {
+            stats_cmd_done(st, buf[5] | (buf[6] << 8), now);
+        } else if (buf[1] == EVT_NUM_COMP_PKTS && len >= 4) {
+            /* num handles, then (handle, count) pairs */
+            for (i = 0, n = buf[3]; i < n && 4 + i * 4 + 3 < len; i++) {
+                hs = stats_handle(st, acl_handle((buf[4 + i * 4] |
+                        (buf[5 + i * 4] << 8))));
+                if (hs)
+                    hs->outstanding -= buf[6 + i * 4] | (buf[7 + i * 4] << 8);
+            }
+        }
+        break;
+    }
+}
+
+static void stats_print(struct hci_stats *st, double secs, FILE *out) {
+    static const char *names[5] = { "other", "cmd", "acl", "sco", "event" };
+    int i, b, n;
+
+    fprintf(out, "--- %.1fs\n", secs);
+    for (i = 0; i < 5; i++) {
+        if (!st->pkts[0][i] && !st->pkts[1][i])
+            continue;
+        fprintf(out, "%-6s out %6u pkts %8.0f B/s   in %6u pkts %8.0f B/s\n",
+                names[i], st->pkts[0][i], st->bytes[0][i] / secs,
+                st->pkts[1][i], st->bytes[1][i] / secs);
+    }
+
+    for (i = 0; i < st->nopcodes; i++) {
+        struct opcode_stats *op = &st->opcodes[i];
+        unsigned int median = 0;
+
+        if (!op->count)
+            continue;
+        for (b = 0, n = 0; b < STATS_LAT_BUCKETS; b++) {
+            n += op->lat[b];
+            if (n * 2 >= (int)op->count) {
+                median = 1u << b;
+                break;
+            }
+        }
+        fprintf(out, "opcode 0x%04x %5u cmds  avg %6lld us  ~median %6u us"
+                "  max %6lld us\n", op->opcode, op->count,
+                (long long)(op->total_us / op->count), median,
+                (long long)op->max_us);
+    }
+
+    for (i = 0; i < st->nhandles; i++) {
+        struct handle_stats *hs = &st->handles[i];
+        fprintf(out, "handle 0x%04x  tx %5u pkts %8.0f B/s  rx %5u pkts %8.0f B/s"
+                "  queued %d (max %d)\n", hs->handle,
+                hs->tx_pkts, hs->tx_bytes / secs,
+                hs->rx_pkts, hs->rx_bytes / secs,
+                hs->outstanding, hs->max_outstanding);
+    }
+    fflush(out);
+}
+
+/* Start a new interval, keeping only what has to carry over. */
+static void stats_reset(struct hci_stats *st) {
+    int i;
+
+    memset(st->pkts, 0, sizeof(st->pkts));
+    memset(st->bytes, 0, sizeof(st->bytes));
+    for (i = 0; i < st->nopcodes; i++) {
+        struct opcode_stats *op = &st->opcodes[i];
+        int64_t sent = op->sent_us;
+        uint16_t opcode = op->opcode;
+        memset(op, 0, sizeof(*op));
+        op->opcode = opcode;
+        op->sent_us = sent;
+    }
+    for (i = 0; i < st->nhandles; i++) {
+        struct handle_stats *hs = &st->handles[i];
+        hs->rx_pkts = hs->tx_pkts = 0;
+        hs->rx_bytes = hs->tx_bytes = 0;
+        hs->max_outstanding = hs->outstanding;
+    }
+}
+
+/* stats [interval seconds] [intervals]: 0 intervals runs until killed */
+static int do_stats(struct hci_engine *eng, int argc, char **argv) {
+    unsigned char buf[HCI_MAX_FRAME_SIZE];
+    char control[64];
+    struct hci_stats *st;
+    struct msghdr msg;
+    struct iovec iv;
+    struct cmsghdr *cmsg;
+    struct pollfd pfd;
+    int interval = argc > 0 ? atoi(argv[0]) : 5;
+    int intervals = argc > 1 ? atoi(argv[1]) : 0;
+    int64_t start, next, now;
+    int len, incoming, done = 0;
+
+    if (interval <= 0) {
+        usage(eng->out);
+        return -1;
+    }
+    st = calloc(1, sizeof(*st));
+    if (!st) {
+        fprintf(eng->out, "Out of memory in %s\n", __FUNCTION__);
+        return -1;
+    }
+    if (hci_set_filter(eng, 1) < 0) {
+        free(st);
+        return -1;
+    }
+
+    start = now_us();
+    next = start + interval * 1000000LL;
+    pfd.fd = eng->sock;
+    pfd.events = POLLIN;
+    while (!intervals || done < intervals) {
+        now = now_us();
+        if (now >= next) {
+            stats_print(st, (now - start) / 1000000.0, eng->out);
+            stats_reset(st);
+            start = now;
+            next = now + interval * 1000000LL;
+            done++;
+            continue;
+        }
+        if (poll(&pfd, 1, (int)((next - now) / 1000) + 1) <= 0)
+            continue;
+
+        iv.iov_base = buf;
+        iv.iov_len = sizeof(buf);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iv;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        len = recvmsg(eng->sock, &msg, 0);
+        if (len <= 0)
+            continue;
+
+        incoming = 1;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+                cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_HCI &&
+                    cmsg->cmsg_type == HCI_CMSG_DIR)
+                incoming = *(int *)CMSG_DATA(cmsg);
+        }
+        stats_packet(st, buf, len, incoming != 0, now_us());
+    }
+
+    hci_set_filter(eng, 0);
+    free(st);
+    return 0;
+}
+
+static int do_batch(struct hci_engine *eng, int argc, char **argv);
+
 struct {
     char *name;
-    int (*ptr)(int argc, char **argv);
+    int (*ptr)(struct hci_engine *eng, int argc, char **argv);
 } function_table[]  = {
     {"sleep", do_sleep},
     {"pri", do_high_priority},
     {"pri_addr", do_high_priority_address},
+    {"qos", do_qos},
+    {"lpm", do_lpm},
+    {"stats", do_stats},
+    {"batch", do_batch},
     {"", do_sleep},
     {NULL, NULL},
 };
 
-static void usage() {
+#define MAX_BATCH_ARGS  16
+
+struct line_reader {
+    int fd;
+    int len;
+    char buf[1024];
+};
+
+/* Returns 1 if a whole line is already buffered. */
+static int line_ready(struct line_reader *r) {
+    return memchr(r->buf, '\n', r->len) != NULL;
+}
+
+/* Read one line into line, returns 0 at end of input. */
+static int read_line(struct line_reader *r, char *line, int size) {
+    char *nl;
+    int n;
+
+    while (!(nl = memchr(r->buf, '\n', r->len))) {
+        if (r->len == (int)sizeof(r->buf))
+            r->len = 0;     /* overlong line, drop it */
+        n = read(r->fd, r->buf + r->len, sizeof(r->buf) - r->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (r->len == 0)
+                return 0;
+            nl = r->buf + r->len;   /* last line without a newline */
+            r->buf[r->len++] = '\n';
+            break;
+        }
+        r->len += n;
+    }
+
+    n = nl - r->buf + 1;
+    if (n > size)
+        n = size;
+    memcpy(line, r->buf, n - 1);
+    line[n - 1] = '\0';
+    r->len -= nl - r->buf + 1;
+    memmove(r->buf, nl + 1, r->len);
+    return 1;
+}
+
+/* Run commands read one per line from fd. Commands are pipelined while
+ * more input is immediately available and each one's completion is reported
+ * on out as "<n> opcode <opcode>: <result>"; errors before a command could be
+ * sent are reported as "<n> <command>: failed (<ret>)". */
+static int run_batch(struct hci_engine *eng, int fd, FILE *out) {
+    struct line_reader reader;
+    struct pollfd pfd;
+    char line[256];
+    char *args[MAX_BATCH_ARGS];
+    char *tok, *save;
+    int i, n = 0, failed = 0;
+
+    reader.fd = fd;
+    reader.len = 0;
+    eng->out = out;
+    eng->failed = 0;
+
+    while (read_line(&reader, line, sizeof(line))) {
+        int argc = 0;
+        int ret;
+
+        for (tok = strtok_r(line, " \t\r", &save);
+                tok && argc < MAX_BATCH_ARGS;
+                tok = strtok_r(NULL, " \t\r", &save))
+            args[argc++] = tok;
+        if (argc == 0 || args[0][0] == '#')
+            continue;
+        eng->tag = ++n;
+
+        for (i = 0; function_table[i].name; i++) {
+            if (!strcmp(args[0], function_table[i].name))
+                break;
+        }
+        if (!function_table[i].name || !args[0][0] ||
+                function_table[i].ptr == do_batch) {
+            fprintf(out, "%d %s: unknown command\n", n, args[0]);
+            failed++;
+        } else {
+            ret = (*function_table[i].ptr)(eng, argc - 1, &args[1]);
+            if (ret < 0) {
+                fprintf(out, "%d %s: failed (%d)\n", n, args[0], ret);
+                failed++;
+            }
+        }
+        fflush(out);
+
+        /* keep queueing while the client is ahead of us, otherwise let it
+         * see its results before it sends more */
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (!line_ready(&reader) && poll(&pfd, 1, 0) <= 0)
+            hci_wait_cmds(eng, 0);
+    }
+    hci_wait_cmds(eng, 0);
+
+    return (failed || eng->failed) ? -1 : 0;
+}
+
+/* batch [socket path]: with no argument commands come from stdin, else we
+ * serve clients of a unix socket one at a time until killed */
+static int do_batch(struct hci_engine *eng, int argc, char **argv) {
+    struct sockaddr_un addr;
+    int srv, fd;
+    FILE *f;
+
+    if (argc == 0)
+        return run_batch(eng, STDIN_FILENO, stdout);
+    if (argc != 1) {
+        usage(eng->out);
+        return -1;
+    }
+
+    srv = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (srv < 0) {
+        printf("socket(): %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[0], sizeof(addr.sun_path) - 1);
+    unlink(addr.sun_path);
+    if (bind(srv, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(srv, 1) < 0) {
+        printf("Can't listen on %s. %s(%d)\n", addr.sun_path,
+                strerror(errno), errno);
+        close(srv);
+        return -1;
+    }
+
+    /* a client that goes away before reading its results must not take
+     * the daemon with it, its writes just fail with EPIPE */
+    signal(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+        fd = accept(srv, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        f = fdopen(fd, "w");
+        if (!f) {
+            close(fd);
+            continue;
+        }
+        run_batch(eng, fd, f);
+        fclose(f);
+        eng->out = stdout;
+    }
+
+    printf("accept(): %s (%d)\n", strerror(errno), errno);
+    close(srv);
+    return -1;
+}
+
+static void usage(FILE *out) {
     int i;
 
-    printf("Usage:\n");
+    fprintf(out, "Usage:\n");
     for (i = 0; function_table[i].name; i++) {
-        printf("\tbtconfig %s\n", function_table[i].name);
+        fprintf(out, "\tbtconfig [--sim[=<latency ms>[,<links>]]] %s\n",
+                function_table[i].name);
     }
 }
 
 int main(int argc, char **argv) {
     int i;
 
+    transport = &hci0_transport;
+    if (argc > 1 && !strncmp(argv[1], "--sim", 5)) {
+        if (argv[1][5] == '=')
+            sscanf(argv[1] + 6, "%d,%d", &sim_latency_ms, &sim_links);
+        transport = &sim_transport;
+        argc--;
+        argv++;
+    }
+
     if (argc < 2) {
-        usage();
+        usage(stdout);
         return -1;
     }
     for (i = 0; function_table[i].name; i++) {
         if (!strcmp(argv[1], function_table[i].name)) {
+            struct hci_engine eng;
+            int ret;
+            int sock = transport->open();
+
+            if (sock < 0)
+                return sock;
+            if (hci_engine_init(&eng, sock) < 0) {
+                close(sock);
+                return -1;
+            }
+
             printf("%s\n", function_table[i].name);
-            return (*function_table[i].ptr)(argc - 2, &argv[2]);
+            eng.tag = 1;
+            ret = (*function_table[i].ptr)(&eng, argc - 2, &argv[2]);
+            if (hci_wait_cmds(&eng, 0) < 0 || eng.failed)
+                ret = -1;
+            conn_table_free(&eng.conns);
+            close(sock);
+            return ret;
         }
     }
-    usage();
+    usage(stdout);
     return -1;
 }
@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** Partition budget report for Passion builds (host only)  */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Each partition is given as name=budget:path[:path...]. A regular file is
+ * taken to be a raw image (boot.img, recovery.img) and costs its size in
+ * pages. A directory is a staged yaffs2 tree: every object costs one header
+ * page and every file its data pages on top. Partition totals are rounded up
+ * to whole erase blocks.
+ */
+
+#define MAX_PARTITIONS 8
+
+struct entry {
+    char *path;
+    unsigned long long bytes;   /* flash footprint, page rounded */
+    int part;
+};
+
+struct partition {
+    const char *name;
+    unsigned long long budget;
+    unsigned long long bytes;
+    unsigned long objects;
+};
+
+static struct partition parts[MAX_PARTITIONS];
+static int nparts;
+
+static struct entry *entries;
+static size_t nentries, max_entries;
+
+static unsigned long page_size = 2048;
+static unsigned long block_size = 131072;
+
+static unsigned long long round_up(unsigned long long v, unsigned long to)
+{
+    return (v + to - 1) / to * to;
+}
+
+static int add_entry(const char *path, unsigned long long bytes, int part)
+{
+    if (nentries == max_entries) {
+        size_t n = max_entries ? max_entries * 2 : 256;
+        struct entry *e = realloc(entries, n * sizeof(*e));
+        if (!e)
+            return -1;
+        entries = e;
+        max_entries = n;
+    }
+    entries[nentries].path = strdup(path);
+    if (!entries[nentries].path)
+        return -1;
+    entries[nentries].bytes = bytes;
+    entries[nentries].part = part;
+    nentries++;
+    return 0;
+}
+
+static int walk(const char *path, int part)
+{
+    struct partition *p = &parts[part];
+    struct stat st;
+    DIR *dir;
+    struct dirent *de;
+    int ret = 0;
+
+    if (lstat(path, &st)) {
+        fprintf(stderr, "partsize: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    p->objects++;
+    p->bytes += page_size;
+    if (S_ISREG(st.st_mode)) {
+        unsigned long long bytes = round_up(st.st_size, page_size);
+        p->bytes += bytes;
+        return add_entry(path, bytes + page_size, part);
+    }
+    if (!S_ISDIR(st.st_mode))
+        return 0;
+
+    dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "partsize: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (!ret && (de = readdir(dir))) {
+        char child[PATH_MAX];
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+        ret = walk(child, part);
+    }
+    closedir(dir);
+    return ret;
+}
+
+static int add_path(const char *path, int part)
+{
+    struct stat st;
+
+    if (stat(path, &st)) {
+        fprintf(stderr, "partsize: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (S_ISREG(st.st_mode)) {
+        unsigned long long bytes = round_up(st.st_size, page_size);
+        parts[part].bytes += bytes;
+        parts[part].objects++;
+        return add_entry(path, bytes, part);
+    }
+    return walk(path, part);
+}
+
+/* name=budget:path[:path...] */
+static int add_partition(char *arg)
+{
+    struct partition *p;
+    char *budget, *paths, *path, *end;
+
+    if (nparts == MAX_PARTITIONS) {
+        fprintf(stderr, "partsize: too many partitions\n");
+        return -1;
+    }
+    budget = strchr(arg, '=');
+    paths = budget ? strchr(budget, ':') : NULL;
+    if (!paths) {
+        fprintf(stderr, "partsize: bad partition spec %s\n", arg);
+        return -1;
+    }
+    *budget++ = '\0';
+    *paths++ = '\0';
+
+    p = &parts[nparts];
+    p->name = arg;
+    p->budget = strtoull(budget, &end, 0);
+    if (*end || !p->budget) {
+        fprintf(stderr, "partsize: %s: bad budget %s\n", arg, budget);
+        return -1;
+    }
+
+    for (path = strtok(paths, ":"); path; path = strtok(NULL, ":")) {
+        if (add_path(path, nparts))
+            return -1;
+    }
+    p->bytes = round_up(p->bytes, block_size);
+    nparts++;
+    return 0;
+}
+
+static int by_size(const void *a, const void *b)
+{
+    const struct entry *ea = a, *eb = b;
+
+    if (ea->bytes != eb->bytes)
+        return ea->bytes < eb->bytes ? 1 : -1;
+    return strcmp(ea->path, eb->path);
+}
+
+static void usage(void)
+{
+    printf("Usage:\n"
+           "\tpartsize [-b block_size] [-p page_size] [-w warn_percent] [-n top]\n"
+           "\t\tname=budget:path[:path...] ...\n\n"
+           "Reports the flash footprint of each partition against its budget.\n"
+           "Directories are counted as yaffs2 trees, files as raw images.\n"
+           "Exits with 1 if any partition is over budget.\n");
+}
+
+int main(int argc, char **argv)
+{
+    unsigned warn = 90;
+    unsigned top = 10;
+    int over = 0;
+    int opt, i;
+    size_t n;
+
+    while ((opt = getopt(argc, argv, "b:p:w:n:")) != -1) {
+        switch (opt) {
+        case 'b':
+            block_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            page_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            warn = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            top = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (optind == argc || !block_size || !page_size) {
+        usage();
+        return 2;
+    }
+
+    for (i = optind; i < argc; i++) {
+        if (add_partition(argv[i]))
+            return 2;
+    }
+
+    printf("%-12s %12s %12s %12s %6s\n",
+           "partition", "used", "budget", "free", "used%");
+    for (i = 0; i < nparts; i++) {
+        struct partition *p = &parts[i];
+        unsigned pct = p->bytes * 100 / p->budget;
+        const char *status = "";
+
+        if (p->bytes > p->budget) {
+            status = "  OVER BUDGET";
+            over = 1;
+        } else if (pct >= warn) {
+            status = "  warning";
+        }
+        printf("%-12s %12llu %12llu %12lld %5u%%%s\n", p->name,
+               p->bytes, p->budget, (long long)(p->budget - p->bytes), pct,
+               status);
+    }
+
+    qsort(entries, nentries, sizeof(*entries), by_size);
+    if (top > nentries)
+        top = nentries;
+    if (top) {
+        printf("\nlargest contributors:\n");
+        for (n = 0; n < top; n++) {
+            struct entry *e = &entries[n];
+            printf("%12llu  %-10s %s\n", e->bytes, parts[e->part].name, e->path);
+        }
+    }
+
+    fflush(stdout);
+    for (i = 0; i < nparts; i++) {
+        if (parts[i].bytes > parts[i].budget)
+            fprintf(stderr, "partsize: error: %s is %llu bytes over its budget\n",
+                    parts[i].name, parts[i].bytes - parts[i].budget);
+        else if (parts[i].bytes * 100 / parts[i].budget >= warn)
+            fprintf(stderr, "partsize: warning: %s is within %llu bytes of its budget\n",
+                    parts[i].name, parts[i].budget - parts[i].bytes);
+    }
+    return over;
+}
@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * btconfig_sim_test: runs the btconfig command engine on the host against
+ * the simulated controller. Checks and times one-at-a-time and pipelined
+ * commands, the connection table and a pipelined batch, and exits non-zero
+ * if any check fails.
+ *
+ *   btconfig_sim_test [latency ms] [commands] [links]
+ */
+
+#define main btconfig_main
+#include "../btconfig.c"
+#undef main
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("FAIL: " __VA_ARGS__); \
+            printf("\n"); \
+            failures++; \
+        } \
+    } while (0)
+
+static FILE *devnull;
+
+static int open_engine(struct hci_engine *eng) {
+    int sock = transport->open();
+
+    if (sock < 0)
+        return -1;
+    if (hci_engine_init(eng, sock) < 0) {
+        close(sock);
+        return -1;
+    }
+    /* per-command reports would swamp the timings */
+    eng->out = devnull;
+    return 0;
+}
+
+static void close_engine(struct hci_engine *eng) {
+    conn_table_free(&eng->conns);
+    close(eng->sock);
+}
+
+static void bdaddr_of(bdaddr_t *ba, int i) {
+    memset(ba, 0, sizeof(*ba));
+    ba->b[0] = i & 0xff;
+    ba->b[1] = i >> 8;
+}
+
+/* one command at a time: each waits for its Command Complete */
+static double test_sequential(int cmds) {
+    struct hci_engine eng;
+    int64_t start, us;
+    int i;
+
+    if (open_engine(&eng) < 0)
+        return -1;
+    start = now_us();
+    for (i = 0; i < cmds; i++) {
+        eng.tag = i + 1;
+        if (vendor_high_priority(&eng, 1) < 0 || hci_wait_cmds(&eng, 0) < 0)
+            break;
+    }
+    us = now_us() - start;
+    CHECK(i == cmds && !eng.failed, "sequential: %d of %d sent, %d failed",
+            i, cmds, eng.failed);
+    printf("sequential  %6d cmds %8.1f ms  %8.0f cmds/s  %7.0f us/cmd\n",
+            cmds, us / 1000.0, cmds * 1000000.0 / us, (double)us / cmds);
+    close_engine(&eng);
+    return cmds * 1000000.0 / us;
+}
+
+/* up to MAX_PENDING_CMDS in flight, completions matched by opcode */
+static double test_pipelined(int cmds) {
+    struct hci_engine eng;
+    int64_t start, us;
+    int i, max = 0;
+
+    if (open_engine(&eng) < 0)
+        return -1;
+    start = now_us();
+    for (i = 0; i < cmds; i++) {
+        eng.tag = i + 1;
+        if (i & 1) {
+            if (write_flush_timeout(&eng, 1, 320) < 0)
+                break;
+        } else if (vendor_high_priority(&eng, 1) < 0) {
+            break;
+        }
+        if (eng.npending > max)
+            max = eng.npending;
+    }
+    hci_wait_cmds(&eng, 0);
+    us = now_us() - start;
+    CHECK(i == cmds && !eng.failed && !eng.npending,
+            "pipelined: %d of %d sent, %d failed, %d pending",
+            i, cmds, eng.failed, eng.npending);
+    CHECK(max == MAX_PENDING_CMDS, "pipelined: at most %d in flight", max);
+    printf("pipelined   %6d cmds %8.1f ms  %8.0f cmds/s  %7.0f us/cmd"
+            "  (%d in flight)\n", cmds, us / 1000.0, cmds * 1000000.0 / us,
+            (double)us / cmds, max);
+    close_engine(&eng);
+    return cmds * 1000000.0 / us;
+}
+
+/* lookups against the controller's list, then churn from (dis)connects */
+static void test_conn_table(int links) {
+    struct hci_engine eng;
+    struct conn_entry *e;
+    bdaddr_t ba;
+    int64_t start, us;
+    int i, n, rounds = 0, lookups = 0;
+
+    sim_links = links;
+    if (open_engine(&eng) < 0)
+        return;
+
+    for (i = 1; i <= links; i++) {
+        bdaddr_of(&ba, i);
+        n = get_acl_handle(&eng, ba);
+        CHECK(n == i, "conn table: %d has handle %d", i, n);
+    }
+    CHECK(eng.conns.count == links && eng.conns.size >= 2 * links,
+            "conn table: %d entries in %d slots", eng.conns.count,
+            eng.conns.size);
+
+    /* drop every third link, the probe runs must stay intact */
+    for (i = 1; i <= links; i += 3)
+        conn_table_remove(&eng.conns, i);
+    for (i = 1; i <= links; i++) {
+        bdaddr_of(&ba, i);
+        e = conn_table_find(&eng.conns, &ba);
+        if ((i - 1) % 3 == 0)
+            CHECK(!e, "conn table: %d still there after removal", i);
+        else
+            CHECK(e && e->handle == i, "conn table: lost %d", i);
+    }
+    for (i = 1; i <= links; i += 3) {
+        bdaddr_of(&ba, i);
+        conn_table_insert(&eng.conns, &ba, i);
+    }
+    CHECK(eng.conns.count == links, "conn table: %d entries after churn",
+            eng.conns.count);
+
+    start = now_us();
+    do {
+        for (i = 1; i <= links; i++, lookups++) {
+            bdaddr_of(&ba, i);
+            e = conn_table_find(&eng.conns, &ba);
+            if (!e || e->handle != i)
+                break;
+        }
+        rounds++;
+        us = now_us() - start;
+    } while (i > links && us < 200000);
+    CHECK(i > links, "conn table: lookup of %d failed", i);
+    printf("conn table  %6d links %7d lookups  %8.0f lookups/s\n",
+            links, lookups, lookups * 1000000.0 / us);
+
+    close_engine(&eng);
+    sim_links = 4;
+}
+
+/* a batch written ahead of time is pipelined and reported per command */
+static void test_batch(int cmds) {
+    struct hci_engine eng;
+    char *report = NULL;
+    size_t size = 0;
+    FILE *out;
+    char *p;
+    int fds[2];
+    int64_t start, us;
+    int i, ok = 0, failed = 0, ret;
+
+    if (open_engine(&eng) < 0)
+        return;
+    out = open_memstream(&report, &size);
+    if (!out || pipe(fds) < 0) {
+        CHECK(0, "batch: can't set up (%s)", strerror(errno));
+        close_engine(&eng);
+        return;
+    }
+
+    for (i = 0; i < cmds; i++)
+        write(fds[1], "pri 1\n", 6);
+    write(fds[1], "qos a2dp\n", 9);
+    write(fds[1], "pri_addr 00:00:00:00:00:02\n", 27);
+    write(fds[1], "pri_addr 00:00:00:00:00:ff\n", 27);
+    write(fds[1], "bogus\n", 6);
+    close(fds[1]);
+
+    start = now_us();
+    ret = run_batch(&eng, fds[0], out);
+    us = now_us() - start;
+    fclose(out);
+    close(fds[0]);
+
+    for (p = report; p && (p = strstr(p, ": ok")); p++)
+        ok++;
+    for (p = report; p && (p = strstr(p, ": failed")); p++)
+        failed++;
+    /* a2dp is three commands on each of sim_links links */
+    CHECK(ok == cmds + 3 * sim_links + 1, "batch: %d commands ok", ok);
+    CHECK(failed == 1 && strstr(report, "unknown command") &&
+            strstr(report, "No ACL connection to 00:00:00:00:00:FF"),
+            "batch: errors not reported:\n%s", report);
+    CHECK(ret < 0, "batch: failures not returned");
+    printf("batch       %6d cmds %8.1f ms  %8.0f cmds/s\n",
+            ok, us / 1000.0, ok * 1000000.0 / us);
+
+    free(report);
+    close_engine(&eng);
+}
+
+int main(int argc, char **argv) {
+    int latency = argc > 1 ? atoi(argv[1]) : 2;
+    int cmds = argc > 2 ? atoi(argv[2]) : 200;
+    int links = argc > 3 ? atoi(argv[3]) : 100;
+    double seq, pipe;
+
+    devnull = fopen("/dev/null", "w");
+    transport = &sim_transport;
+    sim_latency_ms = latency;
+
+    seq = test_sequential(cmds);
+    pipe = test_pipelined(cmds * 4);
+    if (seq > 0 && pipe > 0) {
+        printf("pipelining speedup %.1fx\n", pipe / seq);
+        /* 16 in flight against a fixed latency, allow for a slow host */
+        if (latency > 0)
+            CHECK(pipe > 4 * seq, "pipelining gained only %.1fx", pipe / seq);
+    }
+    test_conn_table(links);
+    test_batch(cmds);
+
+    if (failures)
+        printf("%d check(s) failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,2 @@
+/* Host stand-in for <bluedroid/bluetooth.h>; btconfig uses nothing from
+ * it. */
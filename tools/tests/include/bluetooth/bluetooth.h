@@ -0,0 +1,74 @@
+/*
+ * Host stand-in for the BlueZ <bluetooth/bluetooth.h>, just what btconfig
+ * uses, so that btconfig_sim_test builds without the target headers.
+ */
+
+#ifndef __BLUETOOTH_H
+#define __BLUETOOTH_H
+
+#include <ctype.h>
+#include <endian.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#ifndef AF_BLUETOOTH
+#define AF_BLUETOOTH    31
+#endif
+
+#define BTPROTO_HCI     1
+#define SOL_HCI         0
+
+#define htobs(d)        htole16(d)
+#define btohs(d)        le16toh(d)
+
+typedef struct {
+    uint8_t b[6];
+} __attribute__((packed)) bdaddr_t;
+
+static inline int bacmp(const bdaddr_t *ba1, const bdaddr_t *ba2)
+{
+    return memcmp(ba1, ba2, sizeof(bdaddr_t));
+}
+
+static inline void bacpy(bdaddr_t *dst, const bdaddr_t *src)
+{
+    memcpy(dst, src, sizeof(bdaddr_t));
+}
+
+static inline int bachk(const char *str)
+{
+    int i;
+
+    if (strlen(str) != 17)
+        return -1;
+    for (i = 0; i < 17; i++) {
+        if (i % 3 == 2 ? str[i] != ':' : !isxdigit((unsigned char)str[i]))
+            return -1;
+    }
+    return 0;
+}
+
+static inline int str2ba(const char *str, bdaddr_t *ba)
+{
+    unsigned int b[6];
+    int i;
+
+    if (sscanf(str, "%x:%x:%x:%x:%x:%x",
+            &b[5], &b[4], &b[3], &b[2], &b[1], &b[0]) != 6) {
+        memset(ba, 0, sizeof(*ba));
+        return -1;
+    }
+    for (i = 0; i < 6; i++)
+        ba->b[i] = b[i];
+    return 0;
+}
+
+static inline int ba2str(const bdaddr_t *ba, char *str)
+{
+    return sprintf(str, "%2.2X:%2.2X:%2.2X:%2.2X:%2.2X:%2.2X",
+            ba->b[5], ba->b[4], ba->b[3], ba->b[2], ba->b[1], ba->b[0]);
+}
+
+#endif /* __BLUETOOTH_H */
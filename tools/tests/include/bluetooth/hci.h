@@ -0,0 +1,124 @@
+/*
+ * Host stand-in for the BlueZ <bluetooth/hci.h>, just what btconfig uses.
+ */
+
+#ifndef __HCI_H
+#define __HCI_H
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#define HCI_MAX_ACL_SIZE        1024
+#define HCI_MAX_EVENT_SIZE      260
+#define HCI_MAX_FRAME_SIZE      (HCI_MAX_ACL_SIZE + 4)
+
+/* HCI packet types */
+#define HCI_COMMAND_PKT         0x01
+#define HCI_ACLDATA_PKT         0x02
+#define HCI_SCODATA_PKT         0x03
+#define HCI_EVENT_PKT           0x04
+#define HCI_VENDOR_PKT          0xff
+
+/* HCI socket options and control messages */
+#define HCI_DATA_DIR            1
+#define HCI_FILTER              2
+#define HCI_TIME_STAMP          3
+
+#define HCI_CMSG_DIR            0x0001
+#define HCI_CMSG_TSTAMP         0x0002
+
+#define HCIGETCONNLIST          _IOR('H', 212, int)
+
+/* Link types */
+#define SCO_LINK                0x00
+#define ACL_LINK                0x01
+
+/* Command groups */
+#define OGF_LINK_CTL            0x01
+#define OGF_LINK_POLICY         0x02
+#define OGF_HOST_CTL            0x03
+#define OGF_VENDOR_CMD          0x3f
+
+/* Events */
+#define EVT_CONN_COMPLETE       0x03
+typedef struct {
+    uint8_t     status;
+    uint16_t    handle;
+    bdaddr_t    bdaddr;
+    uint8_t     link_type;
+    uint8_t     encr_mode;
+} __attribute__ ((packed)) evt_conn_complete;
+#define EVT_CONN_COMPLETE_SIZE 11
+
+#define EVT_DISCONN_COMPLETE    0x05
+typedef struct {
+    uint8_t     status;
+    uint16_t    handle;
+    uint8_t     reason;
+} __attribute__ ((packed)) evt_disconn_complete;
+#define EVT_DISCONN_COMPLETE_SIZE 4
+
+#define EVT_CMD_COMPLETE        0x0E
+typedef struct {
+    uint8_t     ncmd;
+    uint16_t    opcode;
+} __attribute__ ((packed)) evt_cmd_complete;
+#define EVT_CMD_COMPLETE_SIZE 3
+
+#define EVT_CMD_STATUS          0x0F
+typedef struct {
+    uint8_t     status;
+    uint8_t     ncmd;
+    uint16_t    opcode;
+} __attribute__ ((packed)) evt_cmd_status;
+#define EVT_CMD_STATUS_SIZE 4
+
+#define EVT_NUM_COMP_PKTS       0x13
+
+/* Packet headers */
+#define HCI_COMMAND_HDR_SIZE    3
+#define HCI_EVENT_HDR_SIZE      2
+#define HCI_ACL_HDR_SIZE        4
+
+typedef struct {
+    uint8_t     evt;
+    uint8_t     plen;
+} __attribute__ ((packed)) hci_event_hdr;
+
+#define cmd_opcode_pack(ogf, ocf)   (uint16_t)((ocf & 0x03ff)|(ogf << 10))
+#define cmd_opcode_ogf(op)          (op >> 10)
+#define cmd_opcode_ocf(op)          (op & 0x03ff)
+
+#define acl_handle(h)           (h & 0x0fff)
+
+/* HCI sockets */
+struct sockaddr_hci {
+    sa_family_t     hci_family;
+    unsigned short  hci_dev;
+};
+
+struct hci_filter {
+    uint32_t type_mask;
+    uint32_t event_mask[2];
+    uint16_t opcode;
+};
+
+#define HCI_FLT_TYPE_BITS       31
+#define HCI_FLT_EVENT_BITS      63
+
+struct hci_conn_info {
+    uint16_t    handle;
+    bdaddr_t    bdaddr;
+    uint8_t     type;
+    uint8_t     out;
+    uint16_t    state;
+    uint32_t    link_mode;
+};
+
+struct hci_conn_list_req {
+    uint16_t    dev_id;
+    uint16_t    conn_num;
+    struct hci_conn_info conn_info[0];
+};
+
+#endif /* __HCI_H */
@@ -0,0 +1,40 @@
+/*
+ * Host stand-in for the BlueZ <bluetooth/hci_lib.h>, just the filter
+ * helpers btconfig uses.
+ */
+
+#ifndef __HCI_LIB_H
+#define __HCI_LIB_H
+
+static inline void hci_set_bit(int nr, void *addr)
+{
+    *((uint32_t *) addr + (nr >> 5)) |= (1 << (nr & 31));
+}
+
+static inline void hci_filter_clear(struct hci_filter *f)
+{
+    memset(f, 0, sizeof(*f));
+}
+
+static inline void hci_filter_set_ptype(int t, struct hci_filter *f)
+{
+    hci_set_bit((t == HCI_VENDOR_PKT) ? 0 : (t & HCI_FLT_TYPE_BITS),
+            &f->type_mask);
+}
+
+static inline void hci_filter_all_ptypes(struct hci_filter *f)
+{
+    memset((void *) &f->type_mask, 0xff, sizeof(f->type_mask));
+}
+
+static inline void hci_filter_set_event(int e, struct hci_filter *f)
+{
+    hci_set_bit((e & HCI_FLT_EVENT_BITS), &f->event_mask);
+}
+
+static inline void hci_filter_all_events(struct hci_filter *f)
+{
+    memset((void *) f->event_mask, 0xff, sizeof(f->event_mask));
+}
+
+#endif /* __HCI_LIB_H */
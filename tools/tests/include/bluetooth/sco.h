@@ -0,0 +1,2 @@
+/* Host stand-in for the BlueZ <bluetooth/sco.h>; btconfig uses nothing
+ * from it. */